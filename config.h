@@ -131,6 +131,12 @@
  */
 #define TRY_DENSE_HEAP_START (void *)0x800000000
 
+/*
+ * Size of a huge page.  With huge pages (mdriver -H), the heap mapping is
+ * aligned to this size so that it can be backed by huge pages
+ */
+#define HUGE_PAGE_SIZE (1 << 21) /* 2 MB */
+
 /*********** Parameters controlling sparse memory version of heap ***********/
 
 /*
@@ -0,0 +1,1595 @@
+/*
+ * mbench.c - Microbenchmarks for mm.c
+ *
+ * mdriver measures mm.c by replaying traces, where every block is freed
+ * by the thread that allocated it.  The benchmarks here exercise the
+ * allocation patterns that traces cannot express.  Each benchmark is
+ * selected by name on the command line; with no names, all of them run.
+ *
+ * mbench links against the thread-safe build of mm.c.  mbench-st is
+ * compiled with MT_MODE=0 and links against the regular build; it runs
+ * every benchmark on a single thread and skips those that need more.
+ *
+ *     xfree   Producer/consumer pairs: the producer allocates, the
+ *             consumer frees.  Reports throughput and the latency of
+ *             mm_free, next to the same work done by a single thread.
+ *     tiny    Random replacement in a large working set dominated by
+ *             requests of 8 bytes or less, interleaved with small
+ *             blocks, so frees keep coalescing next to tiny blocks.
+ *     zero    Fills a working set with mm_calloc'ed buffers, then
+ *             replaces them at random, first on a newly mapped heap and
+ *             then on a reset heap whose old contents must be cleared.
+ *     regrow  Doubles buffers of growing size with mm_realloc, next to
+ *             the copying path (mm_malloc, memcpy, mm_free) realloc
+ *             used to take for large blocks.
+ *     giant   Random replacement in a working set of medium and large
+ *             buffers, so large requests are placed in the free space
+ *             that medium blocks coalesce into.
+ *     batch   Allocates rounds of same-sized nodes and frees them in a
+ *             random order, one call at a time and with mm_malloc_batch
+ *             and mm_free_batch.
+ *     region  Serves requests that each allocate a few thousand objects
+ *             and release them all at the end, with mm_malloc/mm_free
+ *             and with a region per request.
+ *     pool    Replays a trace (-f, traces/bdd-nq7.rep by default) with
+ *             mm_malloc/mm_free, then again with the sizes that make up
+ *             most of its requests served from one mm_pool each.
+ *     share   One thread allocates a small block per thread back to back,
+ *             and each thread then keeps updating its own block, with
+ *             blocks packed densely and placed on whole cache lines
+ *             (mm_line_align).
+ *     crowd   256 threads, more than there are cores, each replacing
+ *             small blocks at random in a working set of its own.
+ *             Reports throughput and how much memory the caches hold
+ *             once every block is freed; run it against mbench (thread
+ *             caches) and mbench-percpu (CPU caches, MM_PERCPU).
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#ifndef MT_MODE
+#define MT_MODE 1
+#endif
+
+#include "memlib.h"
+#include "mm.h"
+
+/**********************
+ * Constants and macros
+ **********************/
+
+#define DEFAULT_OPS 200000 /* operations per thread (-n) */
+#define DEFAULT_THREADS 2  /* threads (or pairs of threads) (-t) */
+#define MIN_SIZE 16        /* smallest request size */
+#define MAX_SIZE 512       /* largest request size */
+#define RING_SIZE 256      /* slots in a producer/consumer ring */
+#define CACHE_LINE 64
+#define TINY_LIVE 16384    /* live blocks per thread in the tiny benchmark */
+#define TINY_MAX 8         /* largest "tiny" request size */
+#define ZERO_LIVE 512      /* live buffers per thread in the zero benchmark */
+#define ZERO_MAX 65536     /* largest zeroed buffer */
+#define REGROW_MIN (1 << 18) /* smallest buffer doubled by regrow */
+#define REGROW_MAX (1 << 26) /* largest buffer doubled by regrow */
+#define REGROW_REPS 16       /* times each buffer size is doubled */
+#define GIANT_LIVE 256       /* live buffers in the giant benchmark */
+#define GIANT_MID (1 << 17)  /* medium buffers are smaller than this */
+#define GIANT_MAX (1 << 19)  /* largest buffer */
+#define BATCH_NODES 1024     /* nodes allocated and freed per round */
+#define BATCH_SIZE 48        /* size of each node */
+#define REGION_MIN_OBJS 256  /* fewest objects allocated by a request */
+#define REGION_MAX_OBJS 4096 /* most objects allocated by a request */
+#define REGION_BUF_MAX (1 << 15) /* largest buffer, one object in 64 */
+#define REGION_KEEP 1024     /* long-lived objects, one replaced per request */
+#define POOL_TRACE "traces/bdd-nq7.rep" /* trace the pool benchmark replays */
+#define POOL_SHARE 10        /* percent of a trace's requests a pooled size has */
+#define POOL_MAX 4           /* most pools a replay uses */
+#define SHARE_SIZE 24        /* size of each thread's block in share */
+#define SHARE_REPS 100       /* updates of the block per operation */
+#define CROWD_THREADS 256    /* threads in the crowd benchmark */
+#define CROWD_LIVE 64        /* live blocks per crowd thread */
+
+/* Options shared by all benchmarks */
+typedef struct
+{
+    int nthreads;
+    int nops;
+    const char *trace; /* trace replayed by the pool benchmark */
+} bench_opts_t;
+
+/* A benchmark that can be selected on the command line */
+typedef struct
+{
+    const char *name;
+    void (*run)(const bench_opts_t *opts);
+    const char *desc;
+    bool threaded; /* needs more than one thread */
+} bench_t;
+
+/*********************
+ * Function prototypes
+ *********************/
+
+static void bench_xfree(const bench_opts_t *opts);
+static void bench_tiny(const bench_opts_t *opts);
+static void bench_zero(const bench_opts_t *opts);
+static void bench_regrow(const bench_opts_t *opts);
+static void bench_giant(const bench_opts_t *opts);
+static void bench_batch(const bench_opts_t *opts);
+static void bench_region(const bench_opts_t *opts);
+static void bench_pool(const bench_opts_t *opts);
+static void bench_share(const bench_opts_t *opts);
+static void bench_crowd(const bench_opts_t *opts);
+
+static void usage(const char *prog);
+static void unix_error(const char *msg) __attribute__((noreturn));
+static void app_error(const char *msg) __attribute__((noreturn));
+
+static const bench_t benchmarks[] = {
+    {"xfree", bench_xfree, "cross-thread frees (producer/consumer)", true},
+    {"tiny", bench_tiny, "working set of mostly tiny blocks", false},
+    {"zero", bench_zero, "working set of zeroed buffers (mm_calloc)", false},
+    {"regrow", bench_regrow, "doubling large buffers (mm_realloc)", false},
+    {"giant", bench_giant, "working set of medium and large buffers", false},
+    {"batch", bench_batch, "rounds of same-sized nodes (mm_*_batch)", false},
+    {"region", bench_region, "request-scoped objects (mm_region_*)", false},
+    {"pool", bench_pool, "a trace with its common sizes pooled (mm_pool_*)",
+     false},
+    {"share", bench_share, "false sharing between threads' blocks "
+                           "(mm_line_align)", true},
+    {"crowd", bench_crowd, "many more threads than cores (MM_PERCPU)", true},
+};
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/******************
+ * Shared utilities
+ ******************/
+
+/*
+ * now_ns - Monotonic time in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * next_rand - xorshift64 step, so threads never share random state
+ */
+static uint64_t next_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * rand_size - A request size uniformly drawn from [MIN_SIZE, MAX_SIZE]
+ */
+static size_t rand_size(uint64_t *state)
+{
+    return MIN_SIZE + next_rand(state) % (MAX_SIZE - MIN_SIZE + 1);
+}
+
+/*
+ * heap_reset - Give each benchmark run a fresh, empty heap
+ */
+static void heap_reset(void)
+{
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed");
+}
+
+/*
+ * heap_remap - Give a benchmark run a newly mapped heap, none of whose
+ *     memory has been used yet
+ */
+static void heap_remap(void)
+{
+    mem_deinit();
+    mem_init(false);
+    if (!mm_init())
+        app_error("mm_init failed");
+}
+
+/*
+ * cmp_u64 - qsort comparator for latency samples
+ */
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * print_latency - Sort n samples in place and print p50, p99 and max
+ */
+static void print_latency(uint64_t *samples, size_t n)
+{
+    qsort(samples, n, sizeof(uint64_t), cmp_u64);
+    printf("%8lu%8lu%9lu", (unsigned long)samples[n / 2],
+           (unsigned long)samples[(n * 99) / 100],
+           (unsigned long)samples[n - 1]);
+}
+
+/*
+ * run_threads - Start nthreads copies of body, one per argument, release
+ *     them together and return the wall-clock time until the last one
+ *     finishes, in seconds.  Each argument must begin with a pointer to
+ *     the barrier, which run_threads fills in.
+ */
+static double run_threads(int nthreads, void *(*body)(void *), void *args,
+                          size_t arg_size)
+{
+    pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+    pthread_barrier_t barrier;
+    uint64_t start, end;
+    int t;
+
+    if (tids == NULL)
+        unix_error("malloc failed in run_threads");
+
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (t = 0; t < nthreads; t++)
+    {
+        void *arg = (char *)args + t * arg_size;
+        *(pthread_barrier_t **)arg = &barrier;
+        if (pthread_create(&tids[t], NULL, body, arg) != 0)
+            unix_error("pthread_create failed in run_threads");
+    }
+
+    start = now_ns();
+    pthread_barrier_wait(&barrier);
+    for (t = 0; t < nthreads; t++)
+        pthread_join(tids[t], NULL);
+    end = now_ns();
+
+    pthread_barrier_destroy(&barrier);
+    free(tids);
+    return (end - start) / 1e9;
+}
+
+/**************************************
+ * xfree - cross-thread free benchmark
+ **************************************/
+
+/* Single-producer, single-consumer ring of blocks in flight */
+typedef struct
+{
+    void *slot[RING_SIZE];
+    _Alignas(CACHE_LINE) size_t head; /* next slot to pop (consumer) */
+    _Alignas(CACHE_LINE) size_t tail; /* next slot to push (producer) */
+} ring_t;
+
+/* What an xfree thread does */
+typedef enum
+{
+    PRODUCER, /* allocate and pass blocks on */
+    CONSUMER, /* free blocks passed on by the producer */
+    LOCAL     /* allocate and free its own blocks */
+} xfree_role_t;
+
+/* Per-thread state; the barrier pointer must come first */
+typedef struct
+{
+    pthread_barrier_t *barrier;
+    xfree_role_t role;
+    ring_t *ring;  /* shared with the partner thread, NULL if alone */
+    int nops;      /* blocks to allocate and free */
+    uint64_t seed; /* random state for request sizes */
+    uint64_t *lat; /* mm_free latencies in ns, NULL for producers */
+    bool ok;       /* false if mm_malloc failed */
+} xfree_arg_t;
+
+/*
+ * ring_push - Add a block to the ring, yielding while it is full
+ */
+static void ring_push(ring_t *ring, void *p)
+{
+    size_t tail = ring->tail;
+    while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SIZE)
+        sched_yield();
+    ring->slot[tail % RING_SIZE] = p;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ring_pop - Take the oldest block from the ring, yielding while it is
+ *     empty
+ */
+static void *ring_pop(ring_t *ring)
+{
+    size_t head = ring->head;
+    while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head)
+        sched_yield();
+    void *p = ring->slot[head % RING_SIZE];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+/*
+ * timed_free - mm_free one block and return how long it took in ns.
+ *     The clock reads add a fixed ~20ns to every sample.
+ */
+static uint64_t timed_free(void *p)
+{
+    uint64_t t0 = now_ns();
+    mm_free(p);
+    return now_ns() - t0;
+}
+
+/*
+ * xfree_producer - Allocate nops blocks and hand each one to the consumer,
+ *     then send NULL to say there are no more
+ */
+static void xfree_producer(xfree_arg_t *a)
+{
+    int i;
+
+    for (i = 0; i < a->nops; i++)
+    {
+        char *p = mm_malloc(rand_size(&a->seed));
+        if (p == NULL)
+        {
+            a->ok = false;
+            break;
+        }
+        p[0] = (char)i;
+        ring_push(a->ring, p);
+    }
+    ring_push(a->ring, NULL);
+}
+
+/*
+ * xfree_consumer - Free every block the producer sends, timing each free
+ */
+static void xfree_consumer(xfree_arg_t *a)
+{
+    void *p;
+    int n = 0;
+
+    while ((p = ring_pop(a->ring)) != NULL)
+        a->lat[n++] = timed_free(p);
+    a->nops = n;
+}
+
+/*
+ * xfree_local - Baseline: allocate and free the same blocks on one
+ *     thread, keeping up to RING_SIZE of them live like the ring does
+ */
+static void xfree_local(xfree_arg_t *a)
+{
+    void *live[RING_SIZE];
+    int i, n = 0;
+
+    for (i = 0; i < a->nops; i++)
+    {
+        if (i >= RING_SIZE)
+            a->lat[n++] = timed_free(live[i % RING_SIZE]);
+        char *p = mm_malloc(rand_size(&a->seed));
+        if (p == NULL)
+        {
+            a->ok = false;
+            return;
+        }
+        p[0] = (char)i;
+        live[i % RING_SIZE] = p;
+    }
+    for (i = (a->nops > RING_SIZE ? a->nops - RING_SIZE : 0); i < a->nops;
+         i++)
+        a->lat[n++] = timed_free(live[i % RING_SIZE]);
+}
+
+/*
+ * xfree_thread - Thread body: wait for the start signal, then play the
+ *     thread's role
+ */
+static void *xfree_thread(void *arg)
+{
+    xfree_arg_t *a = (xfree_arg_t *)arg;
+
+    pthread_barrier_wait(a->barrier);
+    switch (a->role)
+    {
+    case PRODUCER:
+        xfree_producer(a);
+        break;
+    case CONSUMER:
+        xfree_consumer(a);
+        break;
+    case LOCAL:
+        xfree_local(a);
+        break;
+    }
+    return NULL;
+}
+
+/*
+ * xfree_run - Run one configuration and print its result line.  With
+ *     cross set, opts->nthreads producer/consumer pairs run at once;
+ *     otherwise the same number of threads each allocate and free alone.
+ */
+static void xfree_run(const bench_opts_t *opts, bool cross)
+{
+    int pairs = opts->nthreads;
+    int nthreads = cross ? 2 * pairs : pairs;
+    xfree_arg_t *args = calloc(nthreads, sizeof(xfree_arg_t));
+    ring_t *rings = aligned_alloc(CACHE_LINE, pairs * sizeof(ring_t));
+    uint64_t *lat = malloc((size_t)pairs * opts->nops * sizeof(uint64_t));
+    size_t nlat = 0;
+    bool ok = true;
+    int t;
+
+    if (args == NULL || rings == NULL || lat == NULL)
+        unix_error("malloc failed in xfree_run");
+    memset(rings, 0, pairs * sizeof(ring_t));
+
+    for (t = 0; t < nthreads; t++)
+    {
+        /* Even threads produce, odd threads consume */
+        int pair = cross ? t / 2 : t;
+        bool frees = !cross || t % 2 == 1;
+        args[t].role = !cross ? LOCAL : (frees ? CONSUMER : PRODUCER);
+        args[t].ring = cross ? &rings[pair] : NULL;
+        args[t].nops = opts->nops;
+        args[t].seed = 0x9e3779b97f4a7c15u * (pair + 1);
+        args[t].lat = frees ? lat + (size_t)pair * opts->nops : NULL;
+        args[t].ok = true;
+    }
+
+    heap_reset();
+    double secs =
+        run_threads(nthreads, xfree_thread, args, sizeof(xfree_arg_t));
+
+    for (t = 0; t < nthreads; t++)
+    {
+        ok = ok && args[t].ok;
+        if (args[t].lat != NULL)
+        {
+            memmove(lat + nlat, args[t].lat, args[t].nops * sizeof(uint64_t));
+            nlat += args[t].nops;
+        }
+    }
+
+    printf("%-7s%8d", cross ? "cross" : "local", nthreads);
+    if (!ok || nlat == 0)
+        printf("%12s\n", "oom");
+    else
+    {
+        printf("%12.0f", 2.0 * nlat / (secs * 1000.0));
+        print_latency(lat, nlat);
+        printf("\n");
+    }
+
+    free(lat);
+    free(rings);
+    free(args);
+}
+
+/*
+ * bench_xfree - Compare frees made by the allocating thread with frees
+ *     made by a different thread
+ */
+static void bench_xfree(const bench_opts_t *opts)
+{
+    printf("%-7s%8s%12s%8s%8s%9s\n", "mode", "threads", "Kops/s",
+           "p50 ns", "p99 ns", "max ns");
+    xfree_run(opts, false);
+    xfree_run(opts, true);
+}
+
+/**************************************
+ * tiny - tiny-allocation benchmark
+ **************************************/
+
+/* Per-thread state; the barrier pointer must come first */
+typedef struct
+{
+    pthread_barrier_t *barrier;
+    int nops;      /* blocks to replace */
+    uint64_t seed; /* random state */
+    bool ok;       /* false if mm_malloc failed */
+} tiny_arg_t;
+
+/*
+ * tiny_size - Three requests in four are tiny, the rest small
+ */
+static size_t tiny_size(uint64_t *state)
+{
+    uint64_t r = next_rand(state);
+    if (r % 8 != 0)
+        return 1 + (r >> 8) % TINY_MAX;
+    return 2 * TINY_MAX + 1 + (r >> 8) % (4 * TINY_MAX);
+}
+
+/*
+ * tiny_thread - Fill a working set, then repeatedly free a random block
+ *     and allocate a replacement
+ */
+static void *tiny_thread(void *arg)
+{
+    tiny_arg_t *a = (tiny_arg_t *)arg;
+    char **live = malloc(TINY_LIVE * sizeof(char *));
+    int i;
+
+    if (live == NULL)
+        unix_error("malloc failed in tiny_thread");
+
+    pthread_barrier_wait(a->barrier);
+    for (i = 0; i < TINY_LIVE + a->nops; i++)
+    {
+        size_t slot = (size_t)i;
+        if (i >= TINY_LIVE)
+        {
+            slot = next_rand(&a->seed) % TINY_LIVE;
+            mm_free(live[slot]);
+        }
+        if ((live[slot] = mm_malloc(tiny_size(&a->seed))) == NULL)
+        {
+            a->ok = false;
+            break;
+        }
+        live[slot][0] = (char)i;
+    }
+    free(live);
+    return NULL;
+}
+
+/*
+ * bench_tiny - Run opts->nthreads independent tiny-block workloads and
+ *     report their aggregate throughput and the final size of the main
+ *     (mem_sbrk) heap
+ */
+static void bench_tiny(const bench_opts_t *opts)
+{
+    tiny_arg_t *args = calloc(opts->nthreads, sizeof(tiny_arg_t));
+    bool ok = true;
+    int t;
+
+    if (args == NULL)
+        unix_error("calloc failed in bench_tiny");
+    for (t = 0; t < opts->nthreads; t++)
+    {
+        args[t].nops = opts->nops;
+        args[t].seed = 0x2545f4914f6cdd1du * (t + 1);
+        args[t].ok = true;
+    }
+
+    heap_reset();
+    double secs =
+        run_threads(opts->nthreads, tiny_thread, args, sizeof(tiny_arg_t));
+    for (t = 0; t < opts->nthreads; t++)
+        ok = ok && args[t].ok;
+
+    printf("%8s%12s%9s\n", "threads", "Kops/s", "heap KB");
+    printf("%8d", opts->nthreads);
+    if (!ok)
+        printf("%12s\n", "oom");
+    else
+    {
+        double nops = (double)opts->nthreads * (TINY_LIVE + 2.0 * opts->nops);
+        printf("%12.0f%9lu\n", nops / (secs * 1000.0),
+               (unsigned long)(mem_heapsize() / 1024));
+    }
+    free(args);
+}
+
+/**************************************
+ * zero - zeroed allocation benchmark
+ **************************************/
+
+/* Per-thread state; the barrier pointer must come first */
+typedef struct
+{
+    pthread_barrier_t *barrier;
+    int nops;          /* buffers to replace after the fill */
+    uint64_t seed;     /* random state */
+    double fill_secs;  /* time to fill the working set */
+    double churn_secs; /* time to replace nops buffers */
+    bool ok;           /* false if mm_calloc failed or returned dirty memory */
+} zero_arg_t;
+
+/*
+ * zero_calloc - Allocate a zeroed buffer of random size, spot-check that
+ *     it is zero and dirty it the way a user would
+ */
+static char *zero_calloc(zero_arg_t *a)
+{
+    size_t size = 1 + next_rand(&a->seed) % ZERO_MAX;
+    char *p = mm_calloc(1, size);
+
+    if (p == NULL || p[0] != 0 || p[size / 2] != 0 || p[size - 1] != 0)
+    {
+        a->ok = false;
+        return p;
+    }
+    p[0] = p[size / 2] = p[size - 1] = 1;
+    return p;
+}
+
+/*
+ * zero_thread - Fill a working set with zeroed buffers, then repeatedly
+ *     free a random buffer and allocate a replacement
+ */
+static void *zero_thread(void *arg)
+{
+    zero_arg_t *a = (zero_arg_t *)arg;
+    char **live = calloc(ZERO_LIVE, sizeof(char *));
+    uint64_t start, filled;
+    int i;
+
+    if (live == NULL)
+        unix_error("calloc failed in zero_thread");
+
+    pthread_barrier_wait(a->barrier);
+    start = now_ns();
+    for (i = 0; i < ZERO_LIVE && a->ok; i++)
+        live[i] = zero_calloc(a);
+    filled = now_ns();
+    for (i = 0; i < a->nops && a->ok; i++)
+    {
+        size_t slot = next_rand(&a->seed) % ZERO_LIVE;
+        mm_free(live[slot]);
+        live[slot] = zero_calloc(a);
+    }
+    a->fill_secs = (filled - start) / 1e9;
+    a->churn_secs = (now_ns() - filled) / 1e9;
+    free(live);
+    return NULL;
+}
+
+/*
+ * zero_run - Run one configuration and print its result line.  With
+ *     fresh set the heap is newly mapped; otherwise it is reset after the
+ *     previous run, so its memory has been used before.
+ */
+static void zero_run(const bench_opts_t *opts, bool fresh)
+{
+    zero_arg_t *args = calloc(opts->nthreads, sizeof(zero_arg_t));
+    double fill_secs = 0, churn_secs = 0;
+    bool ok = true;
+    int t;
+
+    if (args == NULL)
+        unix_error("calloc failed in zero_run");
+    for (t = 0; t < opts->nthreads; t++)
+    {
+        args[t].nops = opts->nops;
+        args[t].seed = 0xbf58476d1ce4e5b9u * (t + 1);
+        args[t].ok = true;
+    }
+
+    if (fresh)
+        heap_remap();
+    else
+        heap_reset();
+    run_threads(opts->nthreads, zero_thread, args, sizeof(zero_arg_t));
+    for (t = 0; t < opts->nthreads; t++)
+    {
+        ok = ok && args[t].ok;
+        if (args[t].fill_secs > fill_secs)
+            fill_secs = args[t].fill_secs;
+        if (args[t].churn_secs > churn_secs)
+            churn_secs = args[t].churn_secs;
+    }
+
+    printf("%-7s%8d", fresh ? "fresh" : "reused", opts->nthreads);
+    if (!ok)
+        printf("%12s\n", "failed");
+    else
+        printf("%12.0f%12.0f\n",
+               (double)opts->nthreads * ZERO_LIVE / (fill_secs * 1000.0),
+               (double)opts->nthreads * opts->nops / (churn_secs * 1000.0));
+    free(args);
+}
+
+/*
+ * bench_zero - Compare mm_calloc on never-used memory with mm_calloc on
+ *     memory that has to be cleared again
+ */
+static void bench_zero(const bench_opts_t *opts)
+{
+    printf("%-7s%8s%12s%12s\n", "heap", "threads", "fill Kops/s",
+           "Kops/s");
+    zero_run(opts, true);
+    zero_run(opts, false);
+}
+
+/**************************************
+ * regrow - large realloc benchmark
+ **************************************/
+
+/*
+ * regrow_copy - Grow a buffer the way realloc does when it cannot resize
+ *     the block: allocate a new one, copy the contents and free the old one
+ */
+static char *regrow_copy(char *p, size_t size, size_t new_size)
+{
+    char *q = mm_malloc(new_size);
+    if (q != NULL)
+    {
+        memcpy(q, p, size);
+        mm_free(p);
+    }
+    return q;
+}
+
+/*
+ * regrow_time - Median time, in microseconds, to double a buffer of size
+ *     bytes whose pages have all been touched, with mm_realloc or by
+ *     copying.  Returns a negative time if an allocation fails or the
+ *     contents are lost.
+ */
+static double regrow_time(size_t size, bool copy)
+{
+    uint64_t samples[REGROW_REPS];
+    int r;
+
+    for (r = 0; r < REGROW_REPS; r++)
+    {
+        char *p = mm_malloc(size);
+        if (p == NULL)
+            return -1;
+        memset(p, r, size);
+
+        uint64_t start = now_ns();
+        char *q = copy ? regrow_copy(p, size, 2 * size)
+                       : mm_realloc(p, 2 * size);
+        samples[r] = now_ns() - start;
+
+        if (q == NULL || q[0] != (char)r || q[size - 1] != (char)r)
+            return -1;
+        mm_free(q);
+    }
+    qsort(samples, REGROW_REPS, sizeof(uint64_t), cmp_u64);
+    return samples[REGROW_REPS / 2] / 1e3;
+}
+
+/*
+ * bench_regrow - Report the cost of doubling buffers from REGROW_MIN to
+ *     REGROW_MAX bytes.  Large blocks have regions of their own, which
+ *     mm_realloc resizes without copying: its cost only grows with the
+ *     page table entries mremap moves, while the copying path touches
+ *     every byte.
+ */
+static void bench_regrow(const bench_opts_t *opts)
+{
+    size_t size;
+
+    printf("%10s%12s%12s\n", "size KB", "realloc us", "copy us");
+    for (size = REGROW_MIN; size <= REGROW_MAX; size *= 4)
+    {
+        heap_reset();
+        double t_realloc = regrow_time(size, false);
+        double t_copy = regrow_time(size, true);
+        printf("%10lu", (unsigned long)(size / 1024));
+        if (t_realloc < 0 || t_copy < 0)
+            printf("%12s\n", "failed");
+        else
+            printf("%12.1f%12.1f\n", t_realloc, t_copy);
+    }
+}
+
+/**************************************
+ * giant - large block placement benchmark
+ **************************************/
+
+/*
+ * giant_size - A buffer size: seven in eight are medium, below GIANT_MID,
+ *     so they always stay in the heap; the rest reach up to GIANT_MAX
+ */
+static size_t giant_size(uint64_t *state)
+{
+    uint64_t r = next_rand(state);
+    if (r % 8 != 0)
+        return GIANT_MID / 4 + (r >> 8) % (GIANT_MID - GIANT_MID / 4);
+    return GIANT_MID + (r >> 8) % (GIANT_MAX - GIANT_MID);
+}
+
+/*
+ * bench_giant - Fill a working set of GIANT_LIVE buffers, then replace
+ *     random ones opts->nops / 100 times.  Reports throughput, the peak
+ *     of the heap plus mapped regions and the peak utilization: live
+ *     payload over that footprint.  Large buffers only land in the heap
+ *     when a free block holds them, so placement shows up in both.
+ */
+static void bench_giant(const bench_opts_t *opts)
+{
+    char *live[GIANT_LIVE];
+    size_t sizes[GIANT_LIVE];
+    uint64_t seed = 0x9e3779b97f4a7c15u;
+    size_t payload = 0, max_payload = 0, max_total = 0;
+    int nops = opts->nops / 100;
+    int i;
+
+    printf("%12s%12s%8s\n", "Kops/s", "peak KB", "util");
+    heap_reset();
+    uint64_t start = now_ns();
+    for (i = 0; i < GIANT_LIVE + nops; i++)
+    {
+        int slot = i < GIANT_LIVE ? i : (int)(next_rand(&seed) % GIANT_LIVE);
+        if (i >= GIANT_LIVE)
+        {
+            mm_free(live[slot]);
+            payload -= sizes[slot];
+        }
+        sizes[slot] = giant_size(&seed);
+        live[slot] = mm_malloc(sizes[slot]);
+        if (live[slot] == NULL)
+        {
+            printf("%12s\n", "oom");
+            return;
+        }
+        live[slot][0] = 1;
+        payload += sizes[slot];
+
+        size_t total = mem_heapsize() + mem_mapsize();
+        if (payload > max_payload)
+            max_payload = payload;
+        if (total > max_total)
+            max_total = total;
+    }
+    double secs = (now_ns() - start) / 1e9;
+    for (i = 0; i < GIANT_LIVE; i++)
+        mm_free(live[i]);
+
+    printf("%12.0f%12lu%7.1f%%\n", 2.0 * (GIANT_LIVE + nops) / (secs * 1000.0),
+           (unsigned long)(max_total / 1024),
+           100.0 * max_payload / max_total);
+}
+
+/**************************************
+ * batch - batch allocation benchmark
+ **************************************/
+
+/*
+ * batch_time - Seconds to allocate and free opts->nops nodes in rounds of
+ *     BATCH_NODES, freeing each round in a random order.  With batch set
+ *     the rounds go through mm_malloc_batch and mm_free_batch.  Returns a
+ *     negative time if an allocation fails.
+ */
+static double batch_time(const bench_opts_t *opts, bool batch)
+{
+    void *nodes[BATCH_NODES];
+    uint64_t seed = 0x94d049bb133111ebu;
+    int rounds = (opts->nops + BATCH_NODES - 1) / BATCH_NODES;
+    int r, i;
+
+    heap_reset();
+    uint64_t start = now_ns();
+    for (r = 0; r < rounds; r++)
+    {
+        if (batch)
+        {
+            if (mm_malloc_batch(BATCH_SIZE, BATCH_NODES, nodes) != BATCH_NODES)
+                return -1;
+        }
+        else
+        {
+            for (i = 0; i < BATCH_NODES; i++)
+                if ((nodes[i] = mm_malloc(BATCH_SIZE)) == NULL)
+                    return -1;
+        }
+        for (i = 0; i < BATCH_NODES; i++)
+            *(char *)nodes[i] = 1;
+
+        for (i = BATCH_NODES - 1; i > 0; i--)
+        {
+            int j = (int)(next_rand(&seed) % (uint64_t)(i + 1));
+            void *tmp = nodes[i];
+            nodes[i] = nodes[j];
+            nodes[j] = tmp;
+        }
+        if (batch)
+            mm_free_batch(nodes, BATCH_NODES);
+        else
+            for (i = 0; i < BATCH_NODES; i++)
+                mm_free(nodes[i]);
+    }
+    return (now_ns() - start) / 1e9;
+}
+
+/*
+ * bench_batch - Compare rounds of single calls with the batch API.  A
+ *     batch is cut from one free block and, freed together, coalesces
+ *     back into it with a single insertion into the free lists.
+ */
+static void bench_batch(const bench_opts_t *opts)
+{
+    double nodes = (double)BATCH_NODES *
+                   ((opts->nops + BATCH_NODES - 1) / BATCH_NODES);
+    double t_single = batch_time(opts, false);
+    double t_batch = batch_time(opts, true);
+
+    printf("%14s%14s\n", "single Kops/s", "batch Kops/s");
+    if (t_single < 0 || t_batch < 0)
+        printf("%12s\n", "failed");
+    else
+        printf("%14.0f%14.0f\n", 2 * nodes / (t_single * 1000.0),
+               2 * nodes / (t_batch * 1000.0));
+}
+
+/**************************************
+ * region - request-scoped allocation benchmark
+ **************************************/
+
+/*
+ * region_size - An object size: mostly small, with one buffer of up to
+ *     REGION_BUF_MAX bytes in 64
+ */
+static size_t region_size(uint64_t *state)
+{
+    uint64_t r = next_rand(state);
+    if (r % 64 != 0)
+        return rand_size(state);
+    return MAX_SIZE + (r >> 8) % (REGION_BUF_MAX - MAX_SIZE);
+}
+
+/*
+ * region_time - Seconds to serve requests that allocate opts->nops
+ *     objects in all.  A request allocates REGION_MIN_OBJS to
+ *     REGION_MAX_OBJS objects, touches them and releases them all; with
+ *     region set they come from a region that is then destroyed.  Each
+ *     request also replaces one of REGION_KEEP long-lived blocks, so the
+ *     heap does not start out empty for every request.  *peak receives
+ *     the most heap and mapped bytes seen at the end of a request.
+ *     Returns a negative time if an allocation fails.
+ */
+static double region_time(const bench_opts_t *opts, bool region,
+                          size_t *peak)
+{
+    void *objs[REGION_MAX_OBJS];
+    void *keep[REGION_KEEP] = {NULL};
+    uint64_t seed = 0xd1b54a32d192ed03u;
+    long done = 0;
+    int req, i;
+
+    heap_reset();
+    *peak = 0;
+    uint64_t start = now_ns();
+    for (req = 0; done < opts->nops; req++)
+    {
+        int nobjs = REGION_MIN_OBJS +
+                    (int)(next_rand(&seed) %
+                          (REGION_MAX_OBJS - REGION_MIN_OBJS + 1));
+        if (nobjs > opts->nops - done)
+            nobjs = (int)(opts->nops - done);
+        mm_region_t *r = NULL;
+        if (region && (r = mm_region_create()) == NULL)
+            return -1;
+        for (i = 0; i < nobjs; i++)
+        {
+            size_t size = region_size(&seed);
+            char *p = region ? mm_region_alloc(r, size) : mm_malloc(size);
+            if (p == NULL)
+                return -1;
+            p[0] = 1;
+            objs[i] = p;
+        }
+
+        int slot = req % REGION_KEEP;
+        mm_free(keep[slot]);
+        if ((keep[slot] = mm_malloc(rand_size(&seed))) == NULL)
+            return -1;
+
+        size_t total = mem_heapsize() + mem_mapsize();
+        if (total > *peak)
+            *peak = total;
+        if (region)
+            mm_region_destroy(r);
+        else
+            for (i = 0; i < nobjs; i++)
+                mm_free(objs[i]);
+        done += nobjs;
+    }
+    double secs = (now_ns() - start) / 1e9;
+    for (i = 0; i < REGION_KEEP; i++)
+        mm_free(keep[i]);
+    return secs;
+}
+
+/*
+ * bench_region - Compare request-scoped objects freed one by one with
+ *     the same objects taken from a region per request, which allocates
+ *     by moving a cursor and frees one chunk at a time.  Reports objects
+ *     allocated and released per second and the peak footprint.
+ */
+static void bench_region(const bench_opts_t *opts)
+{
+    size_t peak_malloc, peak_region;
+    double t_malloc = region_time(opts, false, &peak_malloc);
+    double t_region = region_time(opts, true, &peak_region);
+
+    printf("%14s%14s%12s%12s\n", "malloc Kobj/s", "region Kobj/s",
+           "malloc KB", "region KB");
+    if (t_malloc < 0 || t_region < 0)
+        printf("%12s\n", "failed");
+    else
+        printf("%14.0f%14.0f%12lu%12lu\n", opts->nops / (t_malloc * 1000.0),
+               opts->nops / (t_region * 1000.0),
+               (unsigned long)(peak_malloc / 1024),
+               (unsigned long)(peak_region / 1024));
+}
+
+/**************************************
+ * pool - fixed-size pool benchmark
+ **************************************/
+
+/* One request of a trace replayed by the pool benchmark */
+typedef struct
+{
+    char type;    /* 'a', 'r', 'f' or 'm', as in the trace */
+    int pool;     /* pool serving the block, or -1 for mm_malloc */
+    int id;       /* block id */
+    size_t size;  /* payload size ('a', 'r' and 'm') */
+    size_t align; /* alignment ('m') */
+} pool_op_t;
+
+/* A trace and the sizes it pools */
+typedef struct
+{
+    pool_op_t *ops;
+    int nops;
+    int nids;
+    size_t sizes[POOL_MAX]; /* object size of each pool */
+    int npools;
+    int pooled; /* allocation requests the pools serve */
+    int allocs; /* all allocation requests */
+} pool_trace_t;
+
+/*
+ * pool_read - Read a trace in mdriver's format and pick the sizes that
+ *     each make up at least POOL_SHARE percent of its requests, up to
+ *     POOL_MAX of them.  A block goes to the pool of its size unless its
+ *     id is ever passed to realloc or memalign, which pools cannot serve.
+ */
+static void pool_read(const char *path, pool_trace_t *t)
+{
+    FILE *f = fopen(path, "r");
+    int weight, i, p;
+    size_t data_bytes;
+    char type[16];
+
+    if (f == NULL)
+        unix_error(path);
+    if (fscanf(f, "%d %d %d %zu", &weight, &t->nids, &t->nops,
+               &data_bytes) != 4)
+        app_error("bad trace header");
+    t->ops = calloc(t->nops, sizeof(pool_op_t));
+    bool *unpooled = calloc(t->nids, sizeof(bool));
+    int *pool_of = calloc(t->nids, sizeof(int));
+    if (t->ops == NULL || unpooled == NULL || pool_of == NULL)
+        unix_error("calloc failed in pool_read");
+
+    for (i = 0; i < t->nops; i++)
+    {
+        pool_op_t *op = &t->ops[i];
+        int n = 0;
+        if (fscanf(f, "%15s", type) != 1)
+            app_error("trace ends early");
+        op->type = type[0];
+        switch (op->type)
+        {
+        case 'a':
+        case 'r':
+            n = fscanf(f, "%d %zu", &op->id, &op->size) - 2;
+            break;
+        case 'f':
+            n = fscanf(f, "%d", &op->id) - 1;
+            break;
+        case 'm':
+            n = fscanf(f, "%d %zu %zu", &op->id, &op->align, &op->size) - 3;
+            break;
+        default:
+            n = -1;
+        }
+        if (n != 0 || op->id < 0 || op->id >= t->nids)
+            app_error("bad request in trace");
+        if (op->type == 'r' || op->type == 'm')
+            unpooled[op->id] = true;
+        if (op->type == 'a')
+            t->allocs++;
+    }
+    fclose(f);
+
+    /* Pool the most common sizes, most common first */
+    t->npools = 0;
+    while (t->npools < POOL_MAX)
+    {
+        size_t best = 0;
+        int best_count = 0;
+        for (i = 0; i < t->nops; i++)
+        {
+            size_t size = t->ops[i].size;
+            bool taken = (t->ops[i].type != 'a' || size == 0);
+            for (p = 0; p < t->npools && !taken; p++)
+                taken = (t->sizes[p] == size);
+            if (taken || size == best)
+                continue;
+            int count = 0, j;
+            for (j = 0; j < t->nops; j++)
+                count += (t->ops[j].type == 'a' && t->ops[j].size == size);
+            if (count > best_count)
+            {
+                best = size;
+                best_count = count;
+            }
+        }
+        if (best_count * 100 < t->allocs * POOL_SHARE || best_count == 0)
+            break;
+        t->sizes[t->npools++] = best;
+    }
+
+    for (i = 0; i < t->nops; i++)
+    {
+        pool_op_t *op = &t->ops[i];
+        op->pool = -1;
+        if (op->type == 'a')
+        {
+            for (p = 0; p < t->npools && !unpooled[op->id]; p++)
+                if (t->sizes[p] == op->size)
+                    op->pool = p;
+            pool_of[op->id] = op->pool;
+            t->pooled += (op->pool >= 0);
+        }
+        else if (op->type == 'm')
+            pool_of[op->id] = -1;
+        else if (op->type == 'f')
+            op->pool = pool_of[op->id];
+    }
+    free(unpooled);
+    free(pool_of);
+}
+
+/*
+ * pool_run - Replay the trace once into blocks, with the pooled sizes
+ *     served from pool[] unless it is NULL.  *peak is raised to the most
+ *     heap and mapped bytes seen after an allocation.  Returns the time in
+ *     seconds, or a negative time if an allocation fails.
+ */
+static double pool_run(const pool_trace_t *t, mm_pool_t **pool,
+                       void **blocks, size_t *peak)
+{
+    uint64_t start = now_ns();
+    int i;
+
+    for (i = 0; i < t->nops; i++)
+    {
+        const pool_op_t *op = &t->ops[i];
+        bool pooled = pool != NULL && op->pool >= 0;
+        void *bp;
+        switch (op->type)
+        {
+        case 'a':
+            bp = pooled ? mm_pool_alloc(pool[op->pool]) : mm_malloc(op->size);
+            break;
+        case 'r':
+            bp = mm_realloc(blocks[op->id], op->size);
+            break;
+        case 'm':
+            bp = mm_memalign(op->align, op->size);
+            break;
+        default:
+            if (pooled)
+                mm_pool_free(pool[op->pool], blocks[op->id]);
+            else
+                mm_free(blocks[op->id]);
+            blocks[op->id] = NULL;
+            continue;
+        }
+        if (bp == NULL && op->size != 0)
+            return -1;
+        if (bp != NULL)
+            *(char *)bp = 1;
+        blocks[op->id] = bp;
+
+        size_t total = mem_heapsize() + mem_mapsize();
+        if (total > *peak)
+            *peak = total;
+    }
+    return (now_ns() - start) / 1e9;
+}
+
+/*
+ * pool_replay - Seconds to replay the trace once on a fresh heap, through
+ *     mm_malloc and mm_free only, or with its pooled sizes served by
+ *     mm_pool_alloc and mm_pool_free.  Returns a negative time if an
+ *     allocation fails.
+ */
+static double pool_replay(const pool_trace_t *t, bool pools, size_t *peak)
+{
+    mm_pool_t *pool[POOL_MAX] = {NULL};
+    void **blocks = calloc(t->nids, sizeof(void *));
+    double secs = -1;
+    bool created = true;
+    int p;
+
+    if (blocks == NULL)
+        unix_error("calloc failed in pool_replay");
+    heap_reset();
+    for (p = 0; pools && p < t->npools; p++)
+        created = created && (pool[p] = mm_pool_create(t->sizes[p])) != NULL;
+    if (created)
+        secs = pool_run(t, pools ? pool : NULL, blocks, peak);
+
+    for (p = 0; p < t->npools; p++)
+        mm_pool_destroy(pool[p]);
+    free(blocks);
+    return secs;
+}
+
+/*
+ * bench_pool - Replay opts->trace at least once and until opts->nops
+ *     requests have run, first through mm_malloc and mm_free, then with
+ *     its most common sizes served from pools, whose objects have no
+ *     header and come off a free list.  Reports requests per second and
+ *     the peak footprint of each.
+ */
+static void bench_pool(const bench_opts_t *opts)
+{
+    pool_trace_t t = {NULL};
+    size_t peak_malloc = 0, peak_pool = 0;
+    double t_malloc = 0, t_pool = 0;
+    int reps, r, p;
+
+    pool_read(opts->trace, &t);
+    reps = (opts->nops + t.nops - 1) / t.nops;
+    printf("%s: pools for sizes", opts->trace);
+    for (p = 0; p < t.npools; p++)
+        printf(" %lu", (unsigned long)t.sizes[p]);
+    printf(" serve %.1f%% of %d mallocs, %d replays\n",
+           100.0 * t.pooled / t.allocs, t.allocs, reps);
+
+    for (r = 0; r < reps && t_malloc >= 0 && t_pool >= 0; r++)
+    {
+        double secs = pool_replay(&t, false, &peak_malloc);
+        t_malloc = secs < 0 ? secs : t_malloc + secs;
+        secs = pool_replay(&t, true, &peak_pool);
+        t_pool = secs < 0 ? secs : t_pool + secs;
+    }
+
+    printf("%14s%14s%12s%12s\n", "malloc Kops/s", "pool Kops/s",
+           "malloc KB", "pool KB");
+    if (t_malloc < 0 || t_pool < 0)
+        printf("%12s\n", "failed");
+    else
+        printf("%14.0f%14.0f%12lu%12lu\n",
+               (double)reps * t.nops / (t_malloc * 1000.0),
+               (double)reps * t.nops / (t_pool * 1000.0),
+               (unsigned long)(peak_malloc / 1024),
+               (unsigned long)(peak_pool / 1024));
+    free(t.ops);
+}
+
+/**************************************
+ * share - false sharing benchmark
+ **************************************/
+
+/* Per-thread state; the barrier pointer must come first */
+typedef struct
+{
+    pthread_barrier_t *barrier;
+    volatile long *block; /* the thread's own block */
+    long updates;         /* times to update it */
+} share_arg_t;
+
+/*
+ * share_thread - Keep incrementing the first word of the thread's block
+ */
+static void *share_thread(void *arg)
+{
+    share_arg_t *a = (share_arg_t *)arg;
+    long i;
+
+    pthread_barrier_wait(a->barrier);
+    for (i = 0; i < a->updates; i++)
+        a->block[0]++;
+    return NULL;
+}
+
+/*
+ * share_run - Allocate a block per thread from the main thread, one after
+ *     the other, with the blocks placed on whole cache lines if lines is
+ *     set, and print the result line: how many blocks share a cache line
+ *     with another and the aggregate update rate.
+ */
+static void share_run(const bench_opts_t *opts, bool lines)
+{
+    share_arg_t *args = calloc(opts->nthreads, sizeof(share_arg_t));
+    int shared = 0;
+    int t, u;
+
+    if (args == NULL)
+        unix_error("calloc failed in share_run");
+
+    heap_reset();
+    mm_line_align(lines ? SHARE_SIZE : 0);
+    for (t = 0; t < opts->nthreads; t++)
+    {
+        if ((args[t].block = mm_calloc(1, SHARE_SIZE)) == NULL)
+            app_error("mm_calloc failed in share_run");
+        args[t].updates = (long)opts->nops * SHARE_REPS;
+    }
+    mm_line_align(0);
+
+    for (t = 0; t < opts->nthreads; t++)
+    {
+        uintptr_t first = (uintptr_t)args[t].block / CACHE_LINE;
+        uintptr_t last = ((uintptr_t)args[t].block + SHARE_SIZE - 1) /
+                         CACHE_LINE;
+        for (u = 0; u < opts->nthreads; u++)
+        {
+            uintptr_t ufirst = (uintptr_t)args[u].block / CACHE_LINE;
+            uintptr_t ulast = ((uintptr_t)args[u].block + SHARE_SIZE - 1) /
+                              CACHE_LINE;
+            if (u != t && first <= ulast && ufirst <= last)
+            {
+                shared++;
+                break;
+            }
+        }
+    }
+
+    double secs =
+        run_threads(opts->nthreads, share_thread, args, sizeof(share_arg_t));
+    printf("%-7s%8d%8d%12.0f\n", lines ? "lines" : "packed", opts->nthreads,
+           shared,
+           (double)opts->nthreads * opts->nops * SHARE_REPS / (secs * 1e6));
+
+    for (t = 0; t < opts->nthreads; t++)
+        mm_free((void *)args[t].block);
+    free(args);
+}
+
+/*
+ * bench_share - Compare blocks of different threads packed densely, as
+ *     mm_malloc places them, with blocks on whole cache lines
+ */
+static void bench_share(const bench_opts_t *opts)
+{
+    printf("%-7s%8s%8s%12s\n", "blocks", "threads", "shared", "Mupdates/s");
+    share_run(opts, false);
+    share_run(opts, true);
+}
+
+/**************************************
+ * crowd - many-thread cache benchmark
+ **************************************/
+
+/* Per-thread state; the barrier pointer must come first */
+typedef struct
+{
+    pthread_barrier_t *barrier;
+    pthread_barrier_t *done; /* shared by the crowd threads alone */
+    int nops;                /* blocks to replace */
+    uint64_t seed;           /* random state for request sizes */
+    mm_stats_t *stats;       /* taken once every block is freed ... */
+    size_t *footprint;       /* ... next to the heap and mapped bytes */
+    bool ok;                 /* false if mm_malloc failed */
+} crowd_arg_t;
+
+/*
+ * crowd_thread - Fill a small working set, replace its blocks at random,
+ *     free them all and wait for the other threads, so that the caches
+ *     are measured full before any thread exits and flushes its own
+ */
+static void *crowd_thread(void *arg)
+{
+    crowd_arg_t *a = (crowd_arg_t *)arg;
+    char *live[CROWD_LIVE];
+    int i, nlive;
+
+    pthread_barrier_wait(a->barrier);
+    for (i = 0; i < CROWD_LIVE + a->nops; i++)
+    {
+        int slot = i;
+        if (i >= CROWD_LIVE)
+        {
+            slot = (int)(next_rand(&a->seed) % CROWD_LIVE);
+            mm_free(live[slot]);
+        }
+        if ((live[slot] = mm_malloc(rand_size(&a->seed))) == NULL)
+        {
+            a->ok = false;
+            break;
+        }
+        live[slot][0] = (char)i;
+    }
+    nlive = (i < CROWD_LIVE) ? i : CROWD_LIVE;
+    for (i = 0; i < nlive; i++)
+        mm_free(live[i]);
+
+    if (pthread_barrier_wait(a->done) == PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+        mm_stats(a->stats);
+        *a->footprint = mem_heapsize() + mem_mapsize();
+    }
+    pthread_barrier_wait(a->done);
+    return NULL;
+}
+
+/*
+ * bench_crowd - Run CROWD_THREADS threads at once and report their
+ *     aggregate throughput, the bytes still held as allocated once every
+ *     block is freed (the caches) and the memory obtained for the heaps
+ */
+static void bench_crowd(const bench_opts_t *opts)
+{
+    crowd_arg_t *args = calloc(CROWD_THREADS, sizeof(crowd_arg_t));
+    pthread_barrier_t done;
+    mm_stats_t stats;
+    size_t footprint = 0;
+    bool ok = true;
+    int t;
+
+    if (args == NULL)
+        unix_error("calloc failed in bench_crowd");
+    memset(&stats, 0, sizeof(stats));
+    pthread_barrier_init(&done, NULL, CROWD_THREADS);
+    for (t = 0; t < CROWD_THREADS; t++)
+    {
+        args[t].done = &done;
+        args[t].nops = opts->nops;
+        args[t].seed = 0xd1b54a32d192ed03u * (t + 1);
+        args[t].stats = &stats;
+        args[t].footprint = &footprint;
+        args[t].ok = true;
+    }
+
+    heap_reset();
+    double secs = run_threads(CROWD_THREADS, crowd_thread, args,
+                              sizeof(crowd_arg_t));
+    for (t = 0; t < CROWD_THREADS; t++)
+        ok = ok && args[t].ok;
+
+    printf("%8s%12s%11s%9s\n", "threads", "Kops/s", "cached KB", "heap KB");
+    printf("%8d", CROWD_THREADS);
+    if (!ok)
+        printf("%12s\n", "oom");
+    else
+    {
+        double nops = (double)CROWD_THREADS * (2.0 * CROWD_LIVE +
+                                               2.0 * opts->nops);
+        printf("%12.0f%11lu%9lu\n", nops / (secs * 1000.0),
+               (unsigned long)(stats.uordblks / 1024),
+               (unsigned long)(footprint / 1024));
+    }
+    pthread_barrier_destroy(&done);
+    free(args);
+}
+
+/**************
+ * Main routine
+ **************/
+int main(int argc, char **argv)
+{
+    bench_opts_t opts = {DEFAULT_THREADS, DEFAULT_OPS, POOL_TRACE};
+    size_t b;
+    int c, i;
+
+    setbuf(stdout, 0);
+
+    while ((c = getopt(argc, argv, "f:n:t:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'f': /* Trace for the pool benchmark */
+            opts.trace = optarg;
+            break;
+
+        case 'n': /* Operations per thread */
+            opts.nops = atoi(optarg);
+            break;
+
+        case 't': /* Threads (or thread pairs) */
+            opts.nthreads = atoi(optarg);
+            break;
+
+        case 'h': /* Print this message */
+            usage(argv[0]);
+            exit(0);
+
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (opts.nops <= 0 || opts.nthreads <= 0)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+#if !MT_MODE
+    /* The regular build of mm.c is not thread-safe */
+    opts.nthreads = 1;
+#endif
+
+    mem_init(false);
+    printf("%ld cpus online, %d ops per thread\n",
+           sysconf(_SC_NPROCESSORS_ONLN), opts.nops);
+
+    for (b = 0; b < NUM_BENCHMARKS; b++)
+    {
+        bool selected = (optind == argc);
+        for (i = optind; i < argc; i++)
+            selected = selected || strcmp(argv[i], benchmarks[b].name) == 0;
+        if (!selected)
+            continue;
+        printf("\n%s: %s\n", benchmarks[b].name, benchmarks[b].desc);
+        if (benchmarks[b].threaded && !MT_MODE)
+        {
+            printf("skipped: needs the thread-safe build (mbench)\n");
+            continue;
+        }
+        benchmarks[b].run(&opts);
+    }
+
+    for (i = optind; i < argc; i++)
+    {
+        for (b = 0; b < NUM_BENCHMARKS; b++)
+            if (strcmp(argv[i], benchmarks[b].name) == 0)
+                break;
+        if (b == NUM_BENCHMARKS)
+            fprintf(stderr, "Unknown benchmark %s\n", argv[i]);
+    }
+
+    mem_deinit();
+    return 0;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(const char *prog)
+{
+    size_t b;
+
+    fprintf(stderr,
+            "Usage: %s [-h] [-f <trace>] [-n <ops>] [-t <threads>] "
+            "[bench...]\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-f <trace> Trace for pool (default %s).\n",
+            POOL_TRACE);
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n <ops>   Operations per thread (default %d).\n",
+            DEFAULT_OPS);
+    fprintf(stderr, "\t-t <n>     Threads, or thread pairs (default %d).\n",
+            DEFAULT_THREADS);
+    fprintf(stderr, "Benchmarks\n");
+    for (b = 0; b < NUM_BENCHMARKS; b++)
+        fprintf(stderr, "\t%-10s %s\n", benchmarks[b].name,
+                benchmarks[b].desc);
+}
+
+/*
+ * unix_error - Report a Unix-style error and exit
+ */
+static void unix_error(const char *msg)
+{
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+/*
+ * app_error - Report an application error and exit
+ */
+static void app_error(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
@@ -15,16 +15,31 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 
 #ifdef USE_MSAN
 #include <sanitizer/msan_interface.h>
 #endif
 
+#ifndef MT_MODE
+#define MT_MODE 0
+#endif
+
+#if MT_MODE
+#include <pthread.h>
+#endif
+
 #include "config.h"
 #include "fcyc.h"
 #include "memlib.h"
@@ -98,10 +113,12 @@ typedef struct
     {
         ALLOC,
         FREE,
-        REALLOC
-    } type;      /* type of request */
-    int index;   /* index for free() to use later */
-    size_t size; /* byte size of alloc/realloc request */
+        REALLOC,
+        MEMALIGN
+    } type;       /* type of request */
+    int index;    /* index for free() to use later */
+    size_t size;  /* byte size of alloc/realloc request */
+    size_t align; /* alignment of memalign request */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -144,6 +161,16 @@ typedef struct
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
+    double realloc_bytes; /* payload bytes realloc had to preserve */
+    double inplace_bytes; /* ... of which stayed put, needing no copy */
+    size_t peak_heap;     /* largest heap size during the trace */
+    size_t final_heap;    /* heap size once the trace has finished */
+    double tlb_misses;    /* dTLB misses in one replay (-M), -1 if unknown */
+    double l1d_misses;    /* L1D load misses in one replay (-L), ... */
+    double l2_misses;     /* ... and L2 misses, each -1 if unknown */
+    bool has_mm_stats;    /* mm keeps statistics (-S) ... */
+    mm_stats_t peak_stats; /* ... these at the peak of the payload ... */
+    mm_stats_t end_stats;  /* ... and these once the trace has finished */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -196,9 +223,29 @@ static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
 size_t queryGlobalSpaceUsage(void);
 #endif
 
+/* Pages backing the heap (-H) */
+static mem_pages_t heap_pages = MEM_PAGES_SMALL;
+
+/* If set, count the dTLB misses of one replay of each trace (-M) */
+static bool count_tlb = false;
+
+/* If set, count the L1D and L2 misses of one replay of each trace (-L) */
+static bool count_cache = false;
+
+/* If set, collect and print the allocator's statistics for each trace (-S) */
+static bool show_mm_stats = false;
+
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+#if MT_MODE
+/* If nonzero, replay each trace on 1 up to mt_threads threads (-P) */
+static int mt_threads = 0;
+
+/* Number of timed runs per thread count; the fastest one is reported */
+#define MT_RUNS 3
+#endif
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -251,15 +298,32 @@ static void free_trace(trace_t *trace);
 /* Routines for evaluating the correctness and speed of libc malloc */
 static bool eval_libc_valid(trace_t *trace);
 static void eval_libc_speed(void *ptr);
+static void *libc_memalign(size_t align, size_t size);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static double count_tlb_misses(speed_t *speed_params);
+static void count_cache_misses(speed_t *speed_params, stats_t *stats);
+static void *trace_memalign(size_t align, size_t size);
+
+#if MT_MODE
+/* Routines for the multi-threaded scaling replay */
+static double eval_mm_mt_speed(const trace_t *trace, int nthreads);
+static void run_mt_tests(int num_tracefiles, const char *tracedir,
+                         char **tracefiles);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void print_realloc_stats(int n, stats_t *stats);
+static void print_heap_stats(int n, stats_t *stats);
+static void print_tlb_stats(int n, stats_t *stats);
+static void print_cache_stats(int n, stats_t *stats);
+static void print_mm_stats(int n, stats_t *stats);
+static bool collect_mm_stats(mm_stats_t *mstats);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3, 4)));
@@ -336,7 +400,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
@@ -344,6 +408,14 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             mm_stats[i].secs =
                 sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            /* Nothing is counted on the sparse heap, which is not timed */
+            if (count_tlb)
+                mm_stats[i].tlb_misses =
+                    sparse_mode ? -1 : count_tlb_misses(speed_params);
+            if (count_cache && sparse_mode)
+                mm_stats[i].l1d_misses = mm_stats[i].l2_misses = -1;
+            else if (count_cache)
+                count_cache_misses(speed_params, &mm_stats[i]);
         }
 
 #if 0
@@ -388,7 +460,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF)
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:P:H:hpCOVAlDLMST")) != EOF)
     {
         switch (c)
         {
@@ -449,6 +521,30 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'H': /* Back the heap with huge pages */
+            heap_pages = atoi(optarg) == 2   ? MEM_PAGES_HUGETLB
+                         : atoi(optarg) == 1 ? MEM_PAGES_THP
+                                             : MEM_PAGES_SMALL;
+            break;
+
+        case 'M': /* Count dTLB misses */
+            count_tlb = true;
+            break;
+
+        case 'L': /* Count L1D and L2 misses */
+            count_cache = true;
+            break;
+
+        case 'S': /* Print the allocator's statistics */
+            show_mm_stats = true;
+            break;
+
+#if MT_MODE
+        case 'P': /* Multi-threaded scaling replay */
+            mt_threads = atoi(optarg);
+            break;
+#endif
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -472,11 +568,21 @@ int main(int argc, char **argv)
             add_tracefile(default_tracefiles[i]);
     }
 
+#if MT_MODE
+    if (mt_threads > 0)
+    {
+        run_mt_tests(num_global_tracefiles, tracedir, global_tracefiles);
+        exit(0);
+    }
+#endif
+
     if (debug_mode != DBG_NONE)
     {
         init_random_data();
     }
 
+    mem_set_pages(heap_pages);
+
     /* Initialize the timeout */
     if (set_timeout > 0)
     {
@@ -582,6 +688,14 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            print_realloc_stats(num_global_tracefiles, mm_stats);
+            print_heap_stats(num_global_tracefiles, mm_stats);
+            if (count_tlb)
+                print_tlb_stats(num_global_tracefiles, mm_stats);
+            if (count_cache)
+                print_cache_stats(num_global_tracefiles, mm_stats);
+            if (show_mm_stats)
+                print_mm_stats(num_global_tracefiles, mm_stats);
         }
     }
 
@@ -806,9 +920,11 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))
+    /* The payload must lie within the extent of the heap, or within one
+       region the package mapped with mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_mapped(lo, hi))
     {
         malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -1015,7 +1131,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     trace_t *trace;
     char type[MAXLINE];
     int index;
-    size_t size;
+    size_t size, align;
     int max_index = 0;
     int op_index;
     int ignore = 0;
@@ -1092,6 +1208,19 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
             break;
+        case 'm':
+            ignore += fscanf(tracefile, "%u %lu %lu", &index, &align, &size);
+            if (align == 0 || (align & (align - 1)) != 0)
+            {
+                app_error("Alignment %lu is not a power of 2 in tracefile %s\n",
+                          (unsigned long)align, trace->filename);
+            }
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].align = align;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                       trace->filename);
@@ -1221,6 +1350,29 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             randomize_block(trace, index);
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            if ((p = trace_memalign(trace->ops[i].align, size)) == NULL)
+            {
+                malloc_error(trace, i, "mm_memalign failed.");
+                return false;
+            }
+
+            /* The payload must also have the requested alignment */
+            if ((uintptr_t)p % trace->ops[i].align != 0)
+            {
+                malloc_error(trace, i,
+                             "Payload address (%p) not aligned to %zu bytes",
+                             p, trace->ops[i].align);
+                return false;
+            }
+            if (add_range(ranges, p, size, trace, i, index) == 0)
+                return false;
+
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            randomize_block(trace, index);
+            break;
+
         case REALLOC: /* mm_realloc */
             if (!check_index(trace, i, index))
             {
@@ -1307,14 +1459,19 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap in bytes while running the student's malloc
+ *   package on the trace, counting regions it mapped with mem_map. The
+ *   package may give memory back by decrementing the brk pointer or
+ *   unmapping regions, so the final heap size is recorded in stats
+ *   separately.
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   Also records in stats how many payload bytes the reallocs had to
+ *   preserve, and how many of those stayed at the same address so that
+ *   the package did not have to copy them.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
     int i;
     int index;
@@ -1325,6 +1482,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     char *newp, *oldp;
 
     reinit_trace(trace);
+    stats->realloc_bytes = 0;
+    stats->inplace_bytes = 0;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
@@ -1353,6 +1512,23 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             total_size += size;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+
+            if ((p = trace_memalign(trace->ops[i].align, size)) == NULL)
+            {
+                app_error("trace %d: mm_memalign failed in eval_mm_util",
+                          tracenum);
+            }
+
+            /* Remember region and size */
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            total_size += size;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1367,6 +1543,15 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             }
             setUBCheck(true);
 
+            /* Count the bytes a copying realloc would have moved */
+            if (oldp != NULL && newsize != 0)
+            {
+                size = (oldsize < newsize) ? oldsize : newsize;
+                stats->realloc_bytes += size;
+                if (newp == oldp)
+                    stats->inplace_bytes += size;
+            }
+
             /* Remember region and size */
             trace->blocks[index] = newp;
             trace->block_sizes[index] = newsize;
@@ -1398,15 +1583,36 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         }
 
         /* update the high-water mark */
-        max_total_size =
-            (total_size > max_total_size) ? total_size : max_total_size;
+        if (total_size > max_total_size)
+        {
+            max_total_size = total_size;
+            if (show_mm_stats)
+                collect_mm_stats(&stats->peak_stats);
+        }
     }
+    if (show_mm_stats)
+        stats->has_mm_stats = collect_mm_stats(&stats->end_stats);
 
 #if !REF_ONLY
     printf(".");
 #endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    stats->peak_heap = mem_heappeak();
+    stats->final_heap = mem_heapsize() + mem_mapsize();
+    return ((double)max_total_size / (double)stats->peak_heap);
+}
+
+/*
+ * trace_memalign - Serve a memalign request of a trace with mm_memalign.
+ *    The reference packages have no memalign, so their drivers reject it.
+ */
+static void *trace_memalign(size_t align, size_t size)
+{
+#if REF_ONLY
+    app_error("memalign requests need mm_memalign");
+#else
+    return mm_memalign(align, size);
+#endif
 }
 
 /*
@@ -1439,6 +1645,14 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = trace_memalign(trace->ops[i].align, size)) == NULL)
+                app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1468,6 +1682,315 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * open_counter - open a disabled hardware counter of this thread's user
+ *     mode events.  Returns its file descriptor, or -1 if the kernel or
+ *     the CPU does not offer it.
+ */
+static int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * replay_counted - replay a trace once with the counters fds[0..n-1]
+ *     running, storing what each counted in counts (-1 for fds of -1), and
+ *     close them.
+ */
+static void replay_counted(speed_t *speed_params, const int *fds, int n,
+                           double *counts)
+{
+    int i;
+    uint64_t count;
+
+    for (i = 0; i < n; i++)
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    eval_mm_speed(speed_params);
+    for (i = 0; i < n; i++)
+    {
+        counts[i] = -1;
+        if (fds[i] < 0)
+            continue;
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fds[i], &count, sizeof(count)) == sizeof(count))
+            counts[i] = count;
+        close(fds[i]);
+    }
+}
+
+/*
+ * count_tlb_misses - replay a trace once with the dTLB load and store miss
+ *     counters of this thread running.  Returns the sum of the counters the
+ *     CPU provides, or -1 if the kernel offers neither.
+ */
+static double count_tlb_misses(speed_t *speed_params)
+{
+    static const uint64_t ops[] = {PERF_COUNT_HW_CACHE_OP_READ,
+                                   PERF_COUNT_HW_CACHE_OP_WRITE};
+    int fds[2];
+    double counts[2];
+    int i;
+    double misses = -1;
+
+    for (i = 0; i < 2; i++)
+        fds[i] = open_counter(PERF_TYPE_HW_CACHE,
+                              PERF_COUNT_HW_CACHE_DTLB | (ops[i] << 8) |
+                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    if (fds[0] < 0 && fds[1] < 0)
+        return -1;
+
+    replay_counted(speed_params, fds, 2, counts);
+    for (i = 0; i < 2; i++)
+        if (counts[i] >= 0)
+            misses = (misses < 0 ? 0 : misses) + counts[i];
+    return misses;
+}
+
+/*
+ * l2_miss_config - the raw event for demand L2 misses on this CPU, which
+ *     the kernel has no generic name for, or 0 if it is not known.
+ */
+static uint64_t l2_miss_config(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+    {
+        if (ebx == 0x756e6547) /* "GenuineIntel": L2_RQSTS.MISS */
+            return 0x3f24;
+        if (ebx == 0x68747541) /* "AuthenticAMD": L2CacheReqStat misses */
+            return 0x0964;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * count_cache_misses - replay a trace once with the L1D load miss and L2
+ *     miss counters of this thread running, storing their counts in
+ *     stats, or -1 for those the kernel or the CPU does not offer.
+ */
+static void count_cache_misses(speed_t *speed_params, stats_t *stats)
+{
+    uint64_t l2 = l2_miss_config();
+    int fds[2];
+    double counts[2];
+
+    fds[0] = open_counter(PERF_TYPE_HW_CACHE,
+                          PERF_COUNT_HW_CACHE_L1D |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    fds[1] = l2 != 0 ? open_counter(PERF_TYPE_RAW, l2) : -1;
+    replay_counted(speed_params, fds, 2, counts);
+    stats->l1d_misses = counts[0];
+    stats->l2_misses = counts[1];
+}
+
+#if MT_MODE
+/* Per-thread state for the multi-threaded replay */
+typedef struct
+{
+    const trace_t *trace;
+    char **blocks;              /* private copy of the trace's block array */
+    pthread_barrier_t *barrier; /* releases all workers at once */
+    bool ok;                    /* false if the allocator ran out of memory */
+} mt_worker_t;
+
+/*
+ * mt_replay - Thread body for eval_mm_mt_speed.  Replays the whole trace
+ *     against mm, keeping its own block pointers, so that concurrent
+ *     replays never touch each other's blocks.
+ */
+static void *mt_replay(void *arg)
+{
+    mt_worker_t *w = (mt_worker_t *)arg;
+    const trace_t *trace = w->trace;
+    char **blocks = w->blocks;
+    int i, index;
+    char *p;
+
+    pthread_barrier_wait(w->barrier);
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type)
+        {
+        case ALLOC:
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+            {
+                w->ok = false;
+                return NULL;
+            }
+            blocks[index] = p;
+            break;
+
+        case MEMALIGN:
+            p = trace_memalign(trace->ops[i].align, trace->ops[i].size);
+            if (p == NULL)
+            {
+                w->ok = false;
+                return NULL;
+            }
+            blocks[index] = p;
+            break;
+
+        case REALLOC:
+            p = mm_realloc(blocks[index], trace->ops[i].size);
+            if (p == NULL && trace->ops[i].size != 0)
+            {
+                w->ok = false;
+                return NULL;
+            }
+            blocks[index] = p;
+            break;
+
+        case FREE:
+            mm_free(index < 0 ? NULL : blocks[index]);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * eval_mm_mt_speed - Replay the trace concurrently on nthreads threads,
+ *     one full copy per thread, and return the elapsed wall-clock time
+ *     in seconds.  Returns a negative value if mm ran out of memory.
+ */
+static double eval_mm_mt_speed(const trace_t *trace, int nthreads)
+{
+    pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+    mt_worker_t *workers = malloc(nthreads * sizeof(mt_worker_t));
+    pthread_barrier_t barrier;
+    struct timespec start, end;
+    bool ok = true;
+    int t;
+
+    if (tids == NULL || workers == NULL)
+        unix_error("malloc failed in eval_mm_mt_speed");
+
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_mt_speed");
+
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (t = 0; t < nthreads; t++)
+    {
+        workers[t].trace = trace;
+        workers[t].blocks = calloc(trace->num_ids, sizeof(char *));
+        workers[t].barrier = &barrier;
+        workers[t].ok = true;
+        if (workers[t].blocks == NULL)
+            unix_error("calloc failed in eval_mm_mt_speed");
+        if (pthread_create(&tids[t], NULL, mt_replay, &workers[t]) != 0)
+            unix_error("pthread_create failed in eval_mm_mt_speed");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_barrier_wait(&barrier);
+    for (t = 0; t < nthreads; t++)
+        pthread_join(tids[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&barrier);
+
+    for (t = 0; t < nthreads; t++)
+    {
+        ok = ok && workers[t].ok;
+        free(workers[t].blocks);
+    }
+    free(workers);
+    free(tids);
+
+    if (!ok)
+        return -1.0;
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/*
+ * next_thread_count - Thread counts for the scaling replay: powers of two,
+ *     then mt_threads itself, then a value past mt_threads to stop.
+ */
+static int next_thread_count(int n)
+{
+    if (n == mt_threads || 2 * n < mt_threads)
+        return 2 * n;
+    return mt_threads;
+}
+
+/*
+ * run_mt_tests - For each trace, replay it on 1, 2, 4, ... up to mt_threads
+ *     threads at once and print the aggregate throughput and the speedup
+ *     relative to a single thread.
+ */
+static void run_mt_tests(int num_tracefiles, const char *tracedir,
+                         char **tracefiles)
+{
+    stats_t stats;
+    int i, n, r;
+
+    printf("Multi-threaded replay on up to %d threads (%ld cpus online)\n",
+           mt_threads, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s%12s%9s  %s\n", "threads", "Kops/s", "speedup", "trace");
+    for (i = 0; i < num_tracefiles; i++)
+    {
+        mem_init(sparse_mode);
+        trace_t *trace = read_trace(&stats, tracedir, tracefiles[i]);
+        double base_tput = 0.0;
+
+        for (n = 1; n <= mt_threads; n = next_thread_count(n))
+        {
+            double best = -1.0;
+            for (r = 0; r < MT_RUNS; r++)
+            {
+                double secs = eval_mm_mt_speed(trace, n);
+                if (secs < 0)
+                {
+                    best = -1.0;
+                    break;
+                }
+                if (best < 0 || secs < best)
+                    best = secs;
+            }
+            if (best < 0)
+            {
+                printf("%8d%12s%9s  %s\n", n, "oom", "-", trace->filename);
+                break;
+            }
+            double tput = (double)n * trace->num_ops / (best * 1000.0);
+            if (n == 1)
+                base_tput = tput;
+            printf("%8d%12.0f%8.2fx  %s\n", n, tput, tput / base_tput,
+                   trace->filename);
+        }
+
+        free_trace(trace);
+        mem_deinit();
+    }
+}
+#endif /* MT_MODE */
+
+/*
+ * libc_memalign - Allocate size bytes aligned to align with libc, for the
+ *    memalign requests of a trace
+ */
+static void *libc_memalign(size_t align, size_t size)
+{
+    void *p;
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    return posix_memalign(&p, align, size) == 0 ? p : NULL;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1496,6 +2019,16 @@ static bool eval_libc_valid(trace_t *trace)
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case MEMALIGN: /* aligned_alloc */
+            if ((p = libc_memalign(trace->ops[i].align, trace->ops[i].size)) ==
+                NULL)
+            {
+                malloc_error(trace, i, "libc aligned_alloc failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1553,6 +2086,14 @@ static void eval_libc_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* aligned_alloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = libc_memalign(trace->ops[i].align, size)) == NULL)
+                unix_error("aligned_alloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1761,6 +2302,207 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+/*
+ * print_realloc_stats - for each trace that reallocs, prints how many
+ * payload bytes realloc had to preserve and how many of them it avoided
+ * copying by resizing the block in place.
+ */
+static void print_realloc_stats(int n, stats_t *stats)
+{
+    int i;
+    bool header = false;
+
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid || stats[i].realloc_bytes == 0)
+            continue;
+        if (!header)
+        {
+            printf("Realloc copies avoided by resizing in place:\n");
+            printf("%14s%14s%8s  %s\n", "bytes", "in place", "saved",
+                   "trace");
+            header = true;
+        }
+        printf("%14.0f%14.0f%7.1f%%  %s\n", stats[i].realloc_bytes,
+               stats[i].inplace_bytes,
+               100.0 * stats[i].inplace_bytes / stats[i].realloc_bytes,
+               stats[i].filename);
+    }
+    if (header)
+        printf("\n");
+}
+
+/*
+ * print_heap_stats - for each trace after which the heap is smaller than
+ * at its peak, prints both sizes and the share of the peak given back.
+ */
+static void print_heap_stats(int n, stats_t *stats)
+{
+    int i;
+    bool header = false;
+
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid || stats[i].final_heap >= stats[i].peak_heap)
+            continue;
+        if (!header)
+        {
+            printf("Heap memory returned by the end of the trace:\n");
+            printf("%12s%12s%9s  %s\n", "peak KB", "final KB", "returned",
+                   "trace");
+            header = true;
+        }
+        printf("%12.1f%12.1f%8.1f%%  %s\n", stats[i].peak_heap / 1024.0,
+               stats[i].final_heap / 1024.0,
+               100.0 * (stats[i].peak_heap - stats[i].final_heap) /
+                   stats[i].peak_heap,
+               stats[i].filename);
+    }
+    if (header)
+        printf("\n");
+}
+
+/*
+ * print_tlb_stats - for each trace, prints the dTLB misses counted in one
+ * replay (-M), in total and per thousand operations.
+ */
+static void print_tlb_stats(int n, stats_t *stats)
+{
+    int i;
+    bool header = false;
+
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        if (stats[i].tlb_misses < 0)
+        {
+            if (sparse_mode)
+                printf("dTLB misses: not counted in sparse mode\n\n");
+            else
+                printf("dTLB misses: no hardware counters (see "
+                       "/proc/sys/kernel/perf_event_paranoid)\n\n");
+            return;
+        }
+        if (!header)
+        {
+            printf("dTLB misses in one replay (%s pages):\n",
+                   heap_pages == MEM_PAGES_SMALL ? "normal" : "huge");
+            printf("%14s%12s  %s\n", "misses", "per Kop", "trace");
+            header = true;
+        }
+        printf("%14.0f%12.1f  %s\n", stats[i].tlb_misses,
+               1000.0 * stats[i].tlb_misses / stats[i].ops, stats[i].filename);
+    }
+    if (header)
+        printf("\n");
+}
+
+/*
+ * print_cache_stats - for each trace, prints the L1D and L2 misses counted
+ * in one replay (-L) per operation, "-" where there was no counter.
+ */
+static void print_cache_stats(int n, stats_t *stats)
+{
+    int i, j;
+    bool header = false;
+
+    for (i = 0; i < n; i++)
+    {
+        double misses[2] = {stats[i].l1d_misses, stats[i].l2_misses};
+        if (!stats[i].valid)
+            continue;
+        if (misses[0] < 0 && misses[1] < 0)
+        {
+            if (sparse_mode)
+                printf("Cache misses: not counted in sparse mode\n\n");
+            else
+                printf("Cache misses: no hardware counters (see "
+                       "/proc/sys/kernel/perf_event_paranoid)\n\n");
+            return;
+        }
+        if (!header)
+        {
+            printf("Cache misses per operation in one replay:\n");
+            printf("%10s%10s  %s\n", "L1D", "L2", "trace");
+            header = true;
+        }
+        for (j = 0; j < 2; j++)
+        {
+            if (misses[j] < 0)
+                printf("%10s", "-");
+            else
+                printf("%10.3f", misses[j] / stats[i].ops);
+        }
+        printf("  %s\n", stats[i].filename);
+    }
+    if (header)
+        printf("\n");
+}
+
+/*
+ * collect_mm_stats - Take a snapshot of the allocator's statistics.
+ *    Returns false if it keeps none, as the reference packages do not.
+ */
+static bool collect_mm_stats(mm_stats_t *mstats)
+{
+#if REF_ONLY
+    return false;
+#else
+    return mm_stats(mstats);
+#endif
+}
+
+/*
+ * print_mm_stats - for each trace, prints the allocator's statistics (-S):
+ * its free lists and heap at the peak of the payload, how often the heap
+ * grew and how many free blocks fit searches examined.  A second table
+ * lists the free blocks in each free list class at the peak.
+ */
+static void print_mm_stats(int n, stats_t *stats)
+{
+    int i;
+    size_t b;
+
+    for (i = 0; i < n; i++)
+    {
+        if (stats[i].valid && !stats[i].has_mm_stats)
+        {
+            printf("Allocator statistics: none (built with MM_STATS=0)\n\n");
+            return;
+        }
+    }
+
+    printf("Allocator statistics at the payload peak:\n");
+    printf("%10s%10s%10s%10s%9s%10s%8s  %s\n", "free blks", "free KB",
+           "used KB", "mapped KB", "extends", "searches", "steps", "trace");
+    for (i = 0; i < n; i++)
+    {
+        const mm_stats_t *peak = &stats[i].peak_stats;
+        const mm_stats_t *end = &stats[i].end_stats;
+        if (!stats[i].valid)
+            continue;
+        printf("%10zu%10.1f%10.1f%10.1f%9zu%10zu%8.2f  %s\n", peak->ordblks,
+               peak->fordblks / 1024.0, peak->uordblks / 1024.0,
+               peak->hblkhd / 1024.0, end->extends, end->searches,
+               end->searches ? (double)end->search_steps / end->searches : 0.0,
+               stats[i].filename);
+    }
+    printf("\nFree blocks per free list class at the payload peak:\n");
+    for (i = 0; i < n; i++)
+    {
+        const mm_stats_t *peak = &stats[i].peak_stats;
+        if (!stats[i].valid)
+            continue;
+        printf("%s:\n ", stats[i].filename);
+        for (b = 0; b < peak->nbins; b++)
+            if (peak->bin_blocks[b] != 0)
+                printf(" %zu:%zu", b, peak->bin_blocks[b]);
+        printf("\n");
+    }
+    printf("\n");
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -2028,4 +2770,14 @@ static void usage(char *prog)
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-H <i>     Heap pages: 0 normal; 1 transparent huge; "
+                    "2 hugetlb.\n");
+    fprintf(stderr, "\t-L         Count L1D and L2 misses with hardware "
+                    "counters.\n");
+    fprintf(stderr, "\t-M         Count dTLB misses with hardware counters.\n");
+    fprintf(stderr, "\t-S         Print the allocator's statistics.\n");
+#if MT_MODE
+    fprintf(stderr, "\t-P <n>     Replay traces on 1..n threads and report "
+                    "scaling.\n");
+#endif
 }
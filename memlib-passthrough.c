@@ -5,8 +5,10 @@
  * This file allows compiling student malloc implementations so that they can
  * be used as an interpositioning library, and thereby run actual programs.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <assert.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -16,10 +18,24 @@
 static bool init = false;
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
+static unsigned char *mem_fresh;    /* Heap is zero from here upwards */
+static size_t mapped_bytes;         /* Total size of mapped regions */
+static size_t mem_peak;             /* Most heap and mapped bytes at once */
+
+static void update_peak(void) {
+    size_t total = (size_t)(mem_brk - heap) +
+                   __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+    /* mem_map may run on several threads at once */
+    size_t peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+    while (total > peak &&
+           !__atomic_compare_exchange_n(&mem_peak, &peak, total, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
 
 static void ensure_init(void) {
     if (!init) {
-        mem_brk = heap = sbrk(0);
+        mem_brk = mem_fresh = heap = sbrk(0);
         assert(mem_brk != (void *)-1);
         init = true;
     }
@@ -28,6 +44,11 @@ static void ensure_init(void) {
 void *mem_sbrk(intptr_t incr) {
     ensure_init();
 
+    /* A negative incr shrinks the heap, but never below where it started */
+    if (incr < 0 && (size_t)-incr > (size_t)(mem_brk - heap)) {
+        return (void *)-1;
+    }
+
     unsigned char *res = sbrk(incr);
     if (res == (void *)-1) {
         return res;
@@ -35,9 +56,71 @@ void *mem_sbrk(intptr_t incr) {
 
     assert(res == mem_brk);
     mem_brk += incr;
+    /*
+     * The kernel drops the whole pages past a lowered break, and they read
+     * as zero when the heap grows over them again. The rest of the last page
+     * keeps its old contents.
+     */
+    if (incr < 0) {
+        size_t mask = mem_pagesize() - 1;
+        mem_fresh = (unsigned char *)(((uintptr_t)mem_brk + mask) & ~mask);
+    }
+    update_peak();
     return (void *) res;
 }
 
+void *mem_map(size_t size, size_t align) {
+    size_t pagesize = mem_pagesize();
+    if (align < pagesize) {
+        align = pagesize;
+    }
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+
+    /* Over-allocate, then trim the misaligned head and the excess tail */
+    size_t len = size + align;
+    unsigned char *raw = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return (void *)-1;
+    }
+    unsigned char *addr =
+        (unsigned char *)(((uintptr_t)raw + align - 1) & ~(align - 1));
+    if (addr > raw) {
+        munmap(raw, addr - raw);
+    }
+    if (raw + len > addr + size) {
+        munmap(addr + size, (raw + len) - (addr + size));
+    }
+    __atomic_add_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+    update_peak();
+    return (void *)addr;
+}
+
+void *mem_remap(void *addr, size_t old_size, size_t size) {
+    size_t pagesize = mem_pagesize();
+    old_size = (old_size + pagesize - 1) & ~(pagesize - 1);
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+
+    void *new_addr = mremap(addr, old_size, size, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED) {
+        return (void *)-1;
+    }
+    __atomic_add_fetch(&mapped_bytes, size - old_size, __ATOMIC_RELAXED);
+    update_peak();
+    return new_addr;
+}
+
+void mem_unmap(void *addr, size_t size) {
+    size_t pagesize = mem_pagesize();
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+    munmap(addr, size);
+    __atomic_sub_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+}
+
+size_t mem_mapsize(void) {
+    return __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+}
+
 void *mem_heap_lo(void) {
     ensure_init();
     return (void *)heap;
@@ -48,11 +131,25 @@ void *mem_heap_hi(void) {
     return (void *)(mem_brk - 1);
 }
 
+void *mem_heap_fresh(void) {
+    ensure_init();
+    return (void *)mem_fresh;
+}
+
 size_t mem_heapsize(void) {
     ensure_init();
     return (size_t)(mem_brk - heap);
 }
 
+size_t mem_heappeak(void) {
+    ensure_init();
+    return __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+}
+
 size_t mem_pagesize(void) {
     return (size_t)getpagesize();
 }
+
+size_t mem_hugepagesize(void) {
+    return 0;
+}
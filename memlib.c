@@ -32,9 +32,11 @@
  *  sparse emulation has tighter checks.  Commonly, the CPU reports a
  *  BUS ERROR on these accesses, and should be debugged as segmentation faults.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -63,11 +65,21 @@ typedef struct MBLK
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* A region handed out by mem_map */
+typedef struct
+{
+    unsigned char *addr;
+    size_t size;
+} mem_region_t;
+
 /* private global variables */
 static bool sparse = false;         /* Use sparse memory emulation */
+static mem_pages_t pages = MEM_PAGES_SMALL; /* Pages backing the dense heap */
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
+static unsigned char *mem_fresh;    /* Heap is zero from here upwards */
+static size_t mem_peak;             /* Most heap and mapped bytes at once */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats =
@@ -82,6 +94,13 @@ static size_t num_free_pages = 0;          /* Number of free pages */
 static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
 static size_t num_buckets = 0;             /* Number of buckets in page table */
 
+/* Regions mapped with mem_map (dense mode only) */
+static mem_region_t *regions = NULL; /* Currently mapped regions */
+static size_t num_regions = 0;       /* Number of entries in regions */
+static size_t max_regions = 0;       /* Capacity of regions */
+static size_t mapped_bytes = 0;      /* Total size of the mapped regions */
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #ifdef NO_CHECK_UB
 static const bool checkUB = false;
 void setUBCheck(bool val) {}
@@ -114,6 +133,19 @@ static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
 static void print_stats();
+static void unmap_regions(void);
+static void *map_huge_heap(void);
+static void release_pages(unsigned char *new_brk);
+static void update_peak(void);
+
+/*
+ * mem_set_pages - select the pages that back the dense heap from the next
+ *     call to mem_init
+ */
+void mem_set_pages(mem_pages_t kind)
+{
+    pages = kind;
+}
 
 /*
  * mem_init - initialize the memory system model
@@ -146,14 +178,20 @@ void mem_init(bool do_sparse)
         mmap_length = MAX_DENSE_HEAP;
     }
 
-    int dev_zero = open("/dev/zero", O_RDWR);
-    void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
-    void *addr = mmap(start,                  /* suggested start*/
-                      mmap_length,            /* length */
-                      PROT_READ | PROT_WRITE, /* permissions */
-                      MAP_PRIVATE,            /* private or shared? */
-                      dev_zero,               /* fd */
-                      0);                     /* offset */
+    void *addr;
+    if (!sparse && pages != MEM_PAGES_SMALL)
+        addr = map_huge_heap();
+    else
+    {
+        int dev_zero = open("/dev/zero", O_RDWR);
+        void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
+        addr = mmap(start,                  /* suggested start*/
+                    mmap_length,            /* length */
+                    PROT_READ | PROT_WRITE, /* permissions */
+                    MAP_PRIVATE,            /* private or shared? */
+                    dev_zero,               /* fd */
+                    0);                     /* offset */
+    }
     if (addr == MAP_FAILED)
     {
         fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
@@ -173,6 +211,8 @@ void mem_init(bool do_sparse)
     }
     stats_printed = false;
     mem_brk = heap;
+    mem_fresh = heap;
+    mem_peak = 0;
 }
 
 /*
@@ -181,6 +221,7 @@ void mem_init(bool do_sparse)
 void mem_deinit(void)
 {
     print_stats();
+    unmap_regions();
     munmap(heap, mmap_length);
     next_free_page = NULL;
     num_free_pages = 0;
@@ -189,7 +230,8 @@ void mem_deinit(void)
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ *     The old contents stay in place; see mem_heap_fresh.
  */
 void mem_reset_brk()
 {
@@ -216,29 +258,34 @@ void mem_reset_brk()
         /* Mark heap as uninitialized (though payloads may be overwritten by driver!) */
         __msan_allocated_memory(heap, MAX_DENSE_HEAP);
 #endif
+        unmap_regions();
+        if (mem_brk > mem_fresh)
+            mem_fresh = mem_brk;
     }
     mem_brk = heap;
+    mem_peak = 0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap, giving the whole pages past the new
+ * break back to the system, and returns the old break.
  */
 void *mem_sbrk(intptr_t incr)
 {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
-    if (incr < 0)
+    if (incr < 0 && (size_t)-incr > (size_t)(mem_brk - heap))
     {
         ok = false;
         fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
+                "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                "bytes, below its start\n",
+                (long)-incr);
     }
-    else if (mem_brk + incr > mem_max_addr)
+    else if (incr > 0 && mem_brk + incr > mem_max_addr)
     {
         ok = false;
         size_t alloc = mem_brk - heap + incr;
@@ -247,7 +294,8 @@ void *mem_sbrk(intptr_t incr)
                 "heap size of %zd (0x%zx) bytes\n",
                 alloc, alloc);
     }
-    else if (!sparse && sbrk(incr) == (void *)-1)
+    /* The process break is never shrunk: libc may have grown it since */
+    else if (!sparse && incr > 0 && sbrk(incr) == (void *)-1)
     {
         ok = false;
         fprintf(
@@ -259,9 +307,13 @@ void *mem_sbrk(intptr_t incr)
     {
 #ifdef USE_ASAN
         /* Mark the extended section of the heap as addressable */
-        __asan_unpoison_memory_region(mem_brk, incr);
+        if (incr > 0)
+            __asan_unpoison_memory_region(mem_brk, incr);
 #endif
+        if (incr < 0)
+            release_pages(mem_brk + incr);
         mem_brk += incr;
+        update_peak();
         return (void *)old_brk;
     }
     else
@@ -271,6 +323,148 @@ void *mem_sbrk(intptr_t incr)
     }
 }
 
+/*
+ * mem_map - simple model of the mmap function.  Maps a zero-filled region of
+ *     at least size bytes whose start is aligned to align, outside of the
+ *     sbrk heap.  The region is remembered so that resetting the heap can
+ *     release it.
+ */
+void *mem_map(size_t size, size_t align)
+{
+    size_t pagesize = mem_pagesize();
+    /* Callers fall back to the heap, so this is not reported as an error */
+    if (sparse)
+    {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    if (align < pagesize)
+        align = pagesize;
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+
+    /* Over-allocate, then trim the misaligned head and the excess tail */
+    size_t len = size + align;
+    unsigned char *raw = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: mem_map failed.  Could not map %zu bytes\n",
+                size);
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    unsigned char *addr =
+        (unsigned char *)(((uintptr_t)raw + align - 1) & ~(align - 1));
+    if (addr > raw)
+        munmap(raw, addr - raw);
+    if (raw + len > addr + size)
+        munmap(addr + size, (raw + len) - (addr + size));
+
+    pthread_mutex_lock(&region_lock);
+    if (num_regions == max_regions)
+    {
+        max_regions = max_regions ? 2 * max_regions : 16;
+        regions = realloc(regions, max_regions * sizeof(mem_region_t));
+        assert(regions != NULL);
+    }
+    regions[num_regions].addr = addr;
+    regions[num_regions].size = size;
+    num_regions++;
+    mapped_bytes += size;
+    update_peak();
+    pthread_mutex_unlock(&region_lock);
+    return (void *)addr;
+}
+
+/*
+ * mem_remap - simple model of the mremap function.  Resizes a region
+ *     obtained from mem_map to at least size bytes without copying it,
+ *     moving it elsewhere if it cannot grow in place.  A moved region is
+ *     only page aligned.
+ */
+void *mem_remap(void *addr, size_t old_size, size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    size_t i;
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+
+    pthread_mutex_lock(&region_lock);
+    for (i = 0; i < num_regions; i++)
+        if (regions[i].addr == addr)
+            break;
+    if (i == num_regions)
+    {
+        pthread_mutex_unlock(&region_lock);
+        fprintf(stderr, "ERROR: mem_remap failed.  %p is not mapped\n", addr);
+        errno = EINVAL;
+        return (void *)-1;
+    }
+    unsigned char *new_addr =
+        mremap(addr, regions[i].size, size, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED)
+    {
+        pthread_mutex_unlock(&region_lock);
+        fprintf(stderr, "ERROR: mem_remap failed.  Could not map %zu bytes\n",
+                size);
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    mapped_bytes = mapped_bytes - regions[i].size + size;
+    regions[i].addr = new_addr;
+    regions[i].size = size;
+    update_peak();
+    pthread_mutex_unlock(&region_lock);
+    return (void *)new_addr;
+}
+
+/*
+ * mem_unmap - release a region obtained from mem_map
+ */
+void mem_unmap(void *addr, size_t size)
+{
+    size_t i;
+    pthread_mutex_lock(&region_lock);
+    for (i = 0; i < num_regions; i++)
+    {
+        if (regions[i].addr == addr)
+        {
+            munmap(regions[i].addr, regions[i].size);
+            mapped_bytes -= regions[i].size;
+            regions[i] = regions[--num_regions];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&region_lock);
+}
+
+/*
+ * mem_mapped - return true if the bytes lo...hi all lie in one region
+ *     obtained from mem_map
+ */
+bool mem_mapped(const void *lo, const void *hi)
+{
+    size_t i;
+    bool found = false;
+    pthread_mutex_lock(&region_lock);
+    for (i = 0; i < num_regions && !found; i++)
+    {
+        unsigned char *start = regions[i].addr;
+        found = (const unsigned char *)lo >= start &&
+                (const unsigned char *)hi < start + regions[i].size;
+    }
+    pthread_mutex_unlock(&region_lock);
+    return found;
+}
+
+/*
+ * mem_mapsize - return the total size of the regions currently mapped
+ *     with mem_map
+ */
+size_t mem_mapsize()
+{
+    return mapped_bytes;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -287,6 +481,18 @@ void *mem_heap_hi()
     return (void *)(mem_brk - 1);
 }
 
+/*
+ * mem_heap_fresh - return the lowest address above which the heap has
+ *     never been used.  Clearing the whole heap on every reset would be
+ *     charged to the timed runs, so instead only the memory mem_sbrk
+ *     hands out from here upwards is guaranteed to be zero.  Sparse pages
+ *     are cleared when they are allocated, so there it is the heap start.
+ */
+void *mem_heap_fresh()
+{
+    return (void *)mem_fresh;
+}
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -295,6 +501,15 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - heap);
 }
 
+/*
+ * mem_heappeak() - returns the largest number of bytes the heap and the
+ *     mem_map regions have held at once since the heap was last reset
+ */
+size_t mem_heappeak()
+{
+    return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -303,6 +518,15 @@ size_t mem_pagesize()
     return (size_t)getpagesize();
 }
 
+/*
+ * mem_hugepagesize() - returns the size of the huge pages backing the heap,
+ *     or 0 if it uses normal pages
+ */
+size_t mem_hugepagesize()
+{
+    return (sparse || pages == MEM_PAGES_SMALL) ? 0 : HUGE_PAGE_SIZE;
+}
+
 /*************** Memory emulation  *******************/
 
 __int128 mem_read128(const void *addr)
@@ -487,6 +711,18 @@ void hprobe(void *ptr, int offset, size_t count)
 
 /*************** Private Functions *******************/
 
+/* Release every region still mapped with mem_map */
+static void unmap_regions(void)
+{
+    size_t i;
+    pthread_mutex_lock(&region_lock);
+    for (i = 0; i < num_regions; i++)
+        munmap(regions[i].addr, regions[i].size);
+    num_regions = 0;
+    mapped_bytes = 0;
+    pthread_mutex_unlock(&region_lock);
+}
+
 static void print_stats()
 {
     size_t vbytes = mem_heapsize();
@@ -509,6 +745,84 @@ static void print_stats()
     stats_printed = true;
 }
 
+/*
+ * release_pages - model the real sbrk shrinking the heap to new_brk: the
+ *     whole pages past new_brk are returned to the system and read as zero
+ *     when the heap grows over them again.  Sparse pages keep their
+ *     contents instead.
+ */
+static void release_pages(unsigned char *new_brk)
+{
+    /* hugetlb pages can only be released whole */
+    uintptr_t mask = (uintptr_t)(pages == MEM_PAGES_HUGETLB
+                                     ? HUGE_PAGE_SIZE
+                                     : mem_pagesize()) -
+                     1;
+    unsigned char *lo = (unsigned char *)(((uintptr_t)new_brk + mask) & ~mask);
+    unsigned char *hi = (unsigned char *)(((uintptr_t)mem_brk + mask) & ~mask);
+
+#ifdef USE_ASAN
+    __asan_poison_memory_region(new_brk, mem_brk - new_brk);
+#endif
+    if (sparse)
+    {
+        if (mem_brk > mem_fresh)
+            mem_fresh = mem_brk;
+        return;
+    }
+    if (lo < hi)
+        madvise(lo, hi - lo, MADV_DONTNEED);
+    /* Unless older contents lie past the old break, all is zero from lo */
+    if (mem_fresh <= mem_brk)
+        mem_fresh = lo;
+}
+
+/*
+ * map_huge_heap - map the dense heap on huge pages.  MEM_PAGES_HUGETLB takes
+ *     it from the hugetlbfs pool.  Otherwise, or if the pool is too small,
+ *     a mapping one huge page longer than the heap is trimmed to a huge page
+ *     boundary and marked MADV_HUGEPAGE, so that the kernel backs it with
+ *     transparent huge pages as it is touched.
+ */
+static void *map_huge_heap(void)
+{
+    void *start = TRY_DENSE_HEAP_START;
+    if (pages == MEM_PAGES_HUGETLB)
+    {
+        void *addr = mmap(start, mmap_length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED)
+            return addr;
+        fprintf(stderr, "WARNING: no hugetlb pages for the heap, using "
+                        "transparent huge pages\n");
+        pages = MEM_PAGES_THP;
+    }
+
+    size_t len = mmap_length + HUGE_PAGE_SIZE;
+    unsigned char *raw = mmap(start, len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return MAP_FAILED;
+    unsigned char *addr =
+        (unsigned char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) &
+                          ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (addr > raw)
+        munmap(raw, addr - raw);
+    munmap(addr + mmap_length, (raw + len) - (addr + mmap_length));
+    if (madvise(addr, mmap_length, MADV_HUGEPAGE) != 0)
+        fprintf(stderr, "WARNING: transparent huge pages are not available "
+                        "for the heap\n");
+    return addr;
+}
+
+/* Record a new peak of heap and mapped bytes */
+static void update_peak(void)
+{
+    size_t total = mem_heapsize() + mapped_bytes;
+    if (total > mem_peak)
+        mem_peak = total;
+}
+
 /* Given an address, compute the ID  of its page */
 static size_t page_id(const void *addr)
 {
@@ -553,6 +867,7 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
         block->next = page_table[b];
         for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
             block->initSet[i] = 0;
+        memset(block->bytes, 0, SPARSE_PAGE_SIZE);
         page_table[b] = block;
     }
 
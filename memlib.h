@@ -10,6 +10,24 @@
 #include <stdint.h>
 #include <unistd.h>
 
+/** @brief Kinds of pages that can back the dense heap */
+typedef enum {
+    MEM_PAGES_SMALL,  /**< Normal pages */
+    MEM_PAGES_THP,    /**< Transparent huge pages (MADV_HUGEPAGE) */
+    MEM_PAGES_HUGETLB /**< Pages from the hugetlbfs pool, falling back to
+                           transparent huge pages if it is empty */
+} mem_pages_t;
+
+/**
+ * @brief Selects the pages that back the dense heap from the next mem_init.
+ *
+ * Huge pages cut the TLB misses of a large heap. They are ignored in sparse
+ * mode.
+ *
+ * @param[in] pages
+ */
+void mem_set_pages(mem_pages_t pages);
+
 /**
  * @brief
  * @param[in] sparse
@@ -22,23 +40,75 @@ void mem_init(bool sparse);
 void mem_deinit(void);
 
 /**
- * @brief Extends the heap by incr bytes.
+ * @brief Extends the heap by incr bytes, or shrinks it if incr is negative.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. When the heap
+ * shrinks, the whole pages past the new end are given back to the system.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre `-incr <= mem_heapsize()`
  */
 void *mem_sbrk(intptr_t incr);
 
 /**
  * @brief Resets the simulated brk pointer to make an empty heap.
+ *
+ * Any regions still mapped with mem_map are released as well.
  */
 void mem_reset_brk(void);
 
+/**
+ * @brief Maps a new region of memory outside of the sbrk heap.
+ *
+ * This is a simple model of the mmap() function, for allocators that manage
+ * more than one heap. The region is zero-filled and stays mapped until it is
+ * passed to mem_unmap or the heap is reset. Regions are not counted by
+ * mem_heapsize. Not available in sparse mode.
+ *
+ * @param[in] size  The number of bytes to map
+ * @param[in] align The required alignment of the region (a power of two)
+ * @return The start address of the region, or (void *)-1 on failure
+ */
+void *mem_map(size_t size, size_t align);
+
+/**
+ * @brief Resizes a region obtained from mem_map without copying it.
+ *
+ * This is a simple model of the mremap() function with MREMAP_MAYMOVE: a
+ * region that cannot grow in place is moved, keeping its contents, and is
+ * then only page aligned. Bytes added at the end are zero.
+ *
+ * @param[in] addr     The start address returned by mem_map or mem_remap
+ * @param[in] old_size The current size of the region
+ * @param[in] size     The new size of the region
+ * @return The start address of the region, or (void *)-1 on failure, in
+ *         which case the region is left unchanged
+ */
+void *mem_remap(void *addr, size_t old_size, size_t size);
+
+/**
+ * @brief Releases a region obtained from mem_map.
+ * @param[in] addr The start address returned by mem_map or mem_remap
+ * @param[in] size The current size of the region
+ */
+void mem_unmap(void *addr, size_t size);
+
+/**
+ * @brief Checks whether a range of bytes lies in a mem_map region.
+ * @param[in] lo The first byte of the range
+ * @param[in] hi The last byte of the range
+ * @return true if every byte lies in the same region
+ */
+bool mem_mapped(const void *lo, const void *hi);
+
+/**
+ * @brief Returns the number of bytes currently mapped with mem_map.
+ * @return The total size of the mapped regions, in bytes
+ */
+size_t mem_mapsize(void);
+
 /**
  * @brief Finds the low address of the heap.
  * @return The address of the first valid byte in the heap.
@@ -55,18 +125,46 @@ void *mem_heap_lo(void);
  */
 void *mem_heap_hi(void);
 
+/**
+ * @brief Finds the lowest address above which the heap has never been used.
+ *
+ * Memory that mem_sbrk hands out at or above this address is zero-filled,
+ * like memory fresh from the real sbrk(). Memory below it may still hold
+ * data from before the last mem_reset_brk.
+ *
+ * @return The lowest address of never-used heap memory.
+ */
+void *mem_heap_fresh(void);
+
 /**
  * @brief Returns the number of bytes being used by the heap.
  * @return The size of the heap, in bytes
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the largest amount of memory the heap and the mem_map
+ * regions have held at once since the heap was last reset.
+ * @return The peak size of the heap plus mapped regions, in bytes
+ */
+size_t mem_heappeak(void);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
  */
 size_t mem_pagesize(void);
 
+/**
+ * @brief Returns the size of the huge pages backing the heap.
+ *
+ * An allocator can grow and shrink the heap in steps of this size so that
+ * every huge page it touches is used whole.
+ *
+ * @return The huge page size in bytes, or 0 if the heap uses normal pages
+ */
+size_t mem_hugepagesize(void);
+
 /* Functions used for memory emulation */
 
 /**
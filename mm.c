@@ -8,11 +8,22 @@
  *
  *************************************************************************
  *
+ * Free blocks are kept in segregated lists (segList) that belong to an
+ * arena. The last class, of blocks of 256 KiB and more, is a treap keyed by
+ * size and address instead of a list, so it is searched for a best fit.
+ * Small requests are served from slabs of headerless objects carved out of
+ * the heap (MM_SLAB) in the single-threaded build. The main arena owns the
+ * mem_sbrk heap. In the thread-safe build (MM_THREADS), threads are spread
+ * round-robin over further arenas, each growing inside its own mem_map
+ * regions and guarded by its own lock, so threads on different arenas
+ * never contend. Free small blocks are cached per thread there, or per CPU
+ * with MM_PERCPU.
  *
  * @author Jason Hoang <jvhoang@andrew.cmu.edu>
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -32,12 +43,169 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
 #define memset mem_memset
 #define memcpy mem_memcpy
 #endif /* def DRIVER */
 
 /* You can change anything from here onward */
 
+/*
+ * MM_THREADS selects the thread-safe build (mdriver-mt and mm.so). Every
+ * arena is then protected by its own lock, and every thread keeps a small
+ * cache of free small blocks in front of segList.
+ */
+#ifndef MM_THREADS
+#define MM_THREADS 0
+#endif
+
+#if MM_THREADS
+#include <pthread.h>
+#endif
+
+/*
+ * MM_PERCPU gives the thread-safe build one cache of free small blocks per
+ * CPU in place of one per thread, so that hundreds of threads on a few
+ * cores hold no more cached blocks than the cores do. The calling CPU is
+ * read from, and every push and pop made atomic with, the Linux restartable
+ * sequence (rseq) area that glibc 2.35 and later registers for each
+ * thread. Threads keep their own caches where no rseq area is registered.
+ * Only x86-64 is supported.
+ */
+#ifndef MM_PERCPU
+#define MM_PERCPU 0
+#endif
+
+#if MM_PERCPU && !MM_THREADS
+#error "MM_PERCPU needs the thread-safe build"
+#endif
+
+#if MM_PERCPU && !defined(__x86_64__)
+#error "MM_PERCPU is only implemented for x86-64"
+#endif
+
+#if MM_PERCPU
+#include <sys/rseq.h>
+#endif
+
+/*
+ * MM_TLSF selects the two-level segregated fit engine (mdriver-tlsf) in
+ * place of segList. Free blocks are indexed by a power-of-two first level
+ * and a linear second level, with a bitmap per level, so inserting,
+ * removing and finding a fit all take constant time.
+ */
+#ifndef MM_TLSF
+#define MM_TLSF 0
+#endif
+
+/*
+ * MM_COMPACT selects the compact block layout (mdriver-compact): 4-byte
+ * headers and footers, and free list links stored as 32-bit offsets from
+ * the heap prologue instead of pointers. The smallest block then has 16
+ * bytes, so there are no mini chunks, and the heap and every block stay
+ * below 4 GiB. Offsets only reach within the mem_sbrk heap, so this layout
+ * needs the single-threaded build.
+ */
+#ifndef MM_COMPACT
+#define MM_COMPACT 0
+#endif
+
+#if MM_COMPACT && MM_THREADS
+#error "MM_COMPACT needs the single-threaded build"
+#endif
+
+/*
+ * MM_SLAB serves requests of up to slab_max_size bytes that do not fit a
+ * mini block from slabs: aligned heap blocks of slab_size bytes cut into
+ * objects of one size class, with no header, whose free objects are
+ * tracked by a bitmap in the slab. A radix tree over page addresses (see
+ * slab_of) tells free which slab an object belongs to. The thread-safe
+ * build serves small requests from its thread caches instead, so slabs need
+ * the single-threaded build; they are on by default there.
+ */
+#ifndef MM_SLAB
+#define MM_SLAB (!MM_THREADS)
+#endif
+
+#if MM_SLAB && MM_THREADS
+#error "MM_SLAB needs the single-threaded build"
+#endif
+
+/*
+ * MM_TRIM_THRESHOLD is the size from which a free block at the end of the
+ * main heap is trimmed: all but chunksize bytes of it are given back with a
+ * negative mem_sbrk. Pages given back fault in again when the heap regrows,
+ * so a heap that keeps growing and shrinking by less than this is left
+ * alone. Setting it to 0 never trims the heap.
+ */
+#ifndef MM_TRIM_THRESHOLD
+#define MM_TRIM_THRESHOLD (4 * 1024 * 1024)
+#endif
+
+/*
+ * MM_MMAP_THRESHOLD is the block size from which an allocation gets a
+ * mem_map region of its own instead of a block in an arena, so that large
+ * buffers neither fragment the heap nor keep it from being trimmed. The
+ * region is unmapped when the block is freed. Setting it to 0 keeps every
+ * block in the heap.
+ */
+#ifndef MM_MMAP_THRESHOLD
+#define MM_MMAP_THRESHOLD (128 * 1024)
+#endif
+
+/*
+ * MM_GROW_MAX caps the step by which the main heap grows when no free block
+ * fits. The step starts at chunksize, doubles while allocations keep
+ * running out of heap, and halves again once they stop, so a growing heap
+ * makes few mem_sbrk calls. It never exceeds 1/grow_divisor of the heap,
+ * which bounds what the last step adds to the peak heap size. Keep it below
+ * MM_TRIM_THRESHOLD. Setting it to 0 always grows by chunksize.
+ */
+#ifndef MM_GROW_MAX
+#define MM_GROW_MAX (1024 * 1024)
+#endif
+
+/*
+ * MM_LINE_ALIGN is the payload size from which heap blocks are placed on
+ * cache line boundaries and rounded up to whole lines, so that blocks
+ * handed to different threads never share a line. Smaller blocks stay
+ * densely packed. mm_line_align changes it at run time. Setting it to 0
+ * turns the mode off.
+ */
+#ifndef MM_LINE_ALIGN
+#define MM_LINE_ALIGN 0
+#endif
+
+/*
+ * MM_STATS keeps the counters mm_stats reports: free blocks and bytes per
+ * free list class, heap growth and the length of fit searches. They live
+ * in the arenas and are updated under the arena locks, except for those of
+ * mapped blocks. Setting it to 0 removes them, and mm_stats reports
+ * nothing.
+ */
+#ifndef MM_STATS
+#define MM_STATS 1
+#endif
+
+/*
+ * MM_PROFILE builds in the sampling heap profiler (mm_profile_start).
+ * While no profile is being taken, malloc tests one global and free one
+ * more once a profile has been started, so the profiler costs next to
+ * nothing until it is used. Setting it to 0 removes it.
+ */
+#ifndef MM_PROFILE
+#define MM_PROFILE 1
+#endif
+
+#if MM_PROFILE
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdarg.h>
+#endif
+
 /*
  *****************************************************************************
  * If DEBUG is defined (such as when running mdriver-dbg), these macros      *
@@ -67,13 +235,17 @@
 
 /* Basic constants */
 
+#if MM_COMPACT
+typedef uint32_t word_t;
+#else
 typedef uint64_t word_t;
+#endif
 
 /** @brief Word and header size (bytes) */
 static const size_t wsize = sizeof(word_t);
 
-/** @brief Double word size (bytes) */
-static const size_t dsize = 2 * wsize;
+/** @brief Alignment of payloads and block sizes (bytes) */
+static const size_t dsize = 16;
 
 /** @brief Minimum block size (bytes) */
 static const size_t min_block_size = dsize;
@@ -84,18 +256,193 @@ static const size_t min_block_size = dsize;
  */
 static const size_t chunksize = (1 << 12);
 
+/** @brief The growth step is at most the heap size divided by this */
+static const size_t grow_divisor = 64;
+
+/**
+ * @brief The growth step doubles if the heap grew less than this many
+ * heap allocations ago, and halves otherwise
+ */
+static const size_t grow_idle_max = 256;
+
+/** @brief Cache line size (bytes) */
+static const size_t cache_line = 64;
+
+/**
+ * @brief Addresses this many bytes apart map to the same L1D cache set.
+ * New heap chunks and slab objects start at offsets that rotate through
+ * this span in cache_line steps (see next_color), so that their first
+ * lines do not all compete for the same sets.
+ */
+static const size_t color_span = (1 << 12);
+
 /**
  * TODO: mask to get allocated bit from header
  */
 static const word_t alloc_mask = 0x1;
 
-/**
- * TODO: mask to get payload size from header
+/** @brief Mask for the "previous block is allocated" bit */
+static const word_t prev_alloc_mask = 0x2;
+
+#if MM_COMPACT
+/*
+ * The compact layout has neither mini blocks nor secondary arenas, so the
+ * bits those use hold the zero and mapped bits instead, and sizes take up
+ * the rest of the word.
  */
+static const word_t prev_mini_mask = 0x0;
+static const word_t arena_mask = 0x0;
+static const word_t zero_mask = 0x4;
+static const word_t mapped_mask = 0x8;
 static const word_t size_mask = ~(word_t)0xF;
 
+/** @brief Largest heap and block in the compact layout (bytes) */
+static const size_t compact_size_max = (size_t)UINT32_MAX + 1 - 16;
+#else
+/** @brief Mask for the "previous block is a mini block" bit */
+static const word_t prev_mini_mask = 0x4;
+
+/**
+ * @brief Mask for the bit marking blocks that live in a secondary arena.
+ *
+ * It is never set in the single-threaded build.
+ */
+static const word_t arena_mask = 0x8;
+
+/**
+ * @brief Mask to get the size from a header.
+ *
+ * Bits 62 and 63 are never part of a size (the heap is smaller than
+ * 2^62 bytes), which frees them for the slot index of mini blocks.
+ */
+static const word_t size_mask = ~(word_t)0xF & ~((word_t)0x3 << 62);
+
+/**
+ * @brief Mask for the bit marking free blocks that end in known-zero memory.
+ *
+ * Only free heap blocks carry it, so it cannot clash with the slot index
+ * of a mini block. See get_clean.
+ */
+static const word_t zero_mask = (word_t)0x1 << 62;
+
+/**
+ * @brief Mask for the bit marking allocated blocks that own a mem_map
+ * region instead of living in an arena.
+ *
+ * Only such blocks carry it, and they are never mini blocks, so it cannot
+ * clash with the slot index of a mini block. See map_alloc.
+ */
+static const word_t mapped_mask = (word_t)0x1 << 63;
+#endif
+
+/** @brief Shift of the top two slot index bits in a mini block header */
+static const size_t mini_high_shift = 8 * sizeof(word_t) - 2;
+
+/**
+ * @brief Offset of the block in a mem_map region: the payload after the
+ * block's header is aligned
+ */
+static const size_t map_offset = dsize - wsize;
+
+/**
+ * @brief Smallest offset of a known-zero tail: past the header, both free
+ * list pointers and the word holding the offset itself
+ */
+static const size_t clean_offset_min = 4 * wsize;
+
 static const size_t numSegs = 15;
 
+#if MM_TLSF
+/** @brief log2 of the number of second-level classes per first level */
+static const size_t tlsf_sl_log2 = 4;
+
+/** @brief Number of second-level classes per first-level class */
+static const size_t tlsf_sl_count = (1 << 4);
+
+/**
+ * @brief Sizes below this are classed linearly in dsize steps, one
+ * second-level class each, all under first level 0
+ */
+static const size_t tlsf_small_size = (1 << 8);
+
+/** @brief log2(tlsf_small_size), the shift between size and first level */
+static const size_t tlsf_fl_shift = 8;
+
+/** @brief Number of first-level classes, enough for any 64-bit size */
+static const size_t tlsf_fl_count = 64 - 8 + 1;
+#endif
+
+/**
+ * @brief Smallest block in the heap: room for a header, both free list
+ * links and a footer. Smaller requests are served from mini chunks, which
+ * the compact layout does without.
+ */
+#if MM_COMPACT
+static const size_t min_alloc_size = dsize;
+#else
+static const size_t min_alloc_size = 2 * dsize;
+#endif
+
+/** @brief Number of mini blocks carved out of one mini chunk */
+static const size_t mini_chunk_slots = 32;
+
+/** @brief free_slots value of a mini chunk with every slot free */
+static const uint32_t mini_chunk_empty = 0xFFFFFFFF;
+
+/** @brief Block size of the chunks a region bump-allocates from */
+static const size_t region_chunk_size = (1 << 16);
+
+/** @brief Fewest objects a pool's chunk holds, for large object sizes */
+static const size_t pool_chunk_objs = 32;
+
+/**
+ * @brief Largest request served from a slab. Above it, a slab's unused tail
+ * and header cost more than the block headers slabs save.
+ */
+static const size_t slab_max_size = 128;
+
+/** @brief Words of a slab's free bitmap, enough for slab_size / dsize */
+static const size_t slab_map_words = (1 << 12) / 16 / 64;
+
+#if MM_SLAB
+/**
+ * @brief Size of a slab's heap block, and alignment of its payload, so the
+ * slabs of a fresh stretch of heap tile it.
+ */
+static const size_t slab_size = (1 << 12);
+
+/** @brief Number of slab size classes, one per dsize step up to the max */
+static const size_t slab_classes = 128 / 16;
+
+/** @brief Entries in the root of the slab page map, for the top 12 bits */
+static const size_t page_map_root_size = (1 << 12);
+
+/** @brief Inner levels of the slab page map below the root */
+static const size_t page_map_depth = 2;
+
+/** @brief Page number bits each inner level resolves */
+static const size_t page_map_node_bits = 6;
+
+/**
+ * @brief Page number bits a leaf resolves. Together with the levels above
+ * and the page size, the map covers 256 TiB of heap.
+ */
+static const size_t page_map_leaf_bits = 12;
+
+/** @brief Bytes in an inner node or a leaf of the slab page map */
+static const size_t page_map_node_size = 512;
+#endif
+
+/**
+ * @brief A free list or treap link: a block pointer, or in the compact
+ * layout an offset (see link_make)
+ */
+#if MM_COMPACT
+typedef uint32_t link_t;
+#else
+typedef struct block *link_t;
+#endif
+
 /** @brief Represents the header and payload of one block in the heap */
 typedef struct block {
     /** @brief Header contains size + allocation flag */
@@ -107,21 +454,380 @@ typedef struct block {
     union { // Union such that it is a payload if allocated and pointer
             // otherwise
         struct {
-            struct block *next;
-            struct block *prev;
+            link_t next;
+            link_t prev;
         };
+        /** @brief Lower and higher children in the large-block treap */
+        link_t child[2];
         char payload[0];
     };
 
 } block_t;
 
+/**
+ * @brief A heap block cut into mini_chunk_slots mini blocks of
+ * min_block_size bytes, which follow this header.
+ *
+ * No heap block is ever as small as a mini block, so an allocated block of
+ * min_block_size is always a chunk slot. Its header stores the slot index
+ * in the bits a heap block uses for flags and the top two bits, so the
+ * chunk is found in constant time.
+ */
+typedef struct mini_chunk {
+    word_t header;           // header of the heap block holding the chunk
+    uint32_t free_slots;     // bit i is set if slot i is free
+    struct mini_chunk *next; // chunks of the same arena with a free slot
+    struct mini_chunk *prev;
+} mini_chunk_t;
+
+/**
+ * @brief Header at the start of a slab, the payload of a slab_size-aligned
+ * heap block. The objects follow it, padded to dsize bytes, and end before
+ * the header of the next heap block.
+ *
+ * Objects have no header of their own: free finds the slab through the
+ * page map, and the index of an object from its offset times recip.
+ */
+typedef struct slab {
+    uint64_t free_map[slab_map_words]; // bit i is set if object i is free
+    struct slab *next; // slabs of the same class with a free object
+    struct slab *prev;
+    uint32_t recip; // 2^32 / size, rounded up
+    uint16_t size;  // object size, a multiple of dsize
+    uint16_t first; // offset of object 0 from the slab, its cache color
+    uint16_t nobjs; // objects in the slab
+    uint16_t nfree; // free objects
+} slab_t;
+
+/**
+ * @brief Header of a heap block a region or a pool allocates from. The
+ * header is padded to dsize bytes, so the space after it stays aligned.
+ */
+typedef struct region_chunk {
+    struct region_chunk *prev; // chunk allocated before this one
+} region_chunk_t;
+
+/**
+ * @brief A region: blocks bump-allocated out of chunks, all of which are
+ * freed together. It lives at the start of its first chunk.
+ */
+struct mm_region {
+    region_chunk_t *chunks; // newest chunk, which holds cursor
+    char *cursor;           // next unused byte of that chunk
+    char *end;              // end of its payload
+};
+
+/** @brief A free object of a pool, linked through its first word */
+typedef struct pool_object {
+    struct pool_object *next;
+} pool_object_t;
+
+/**
+ * @brief A pool of objects of one size, cut from chunks like a region's
+ * and recycled through a free list.
+ */
+struct mm_pool {
+    pool_object_t *free;    // freed objects, most recently freed first
+    char *cursor;           // next never used object of the newest chunk
+    char *end;              // end of that chunk's payload
+    region_chunk_t *chunks; // newest chunk
+    size_t size;            // object size, a multiple of dsize
+};
+
+#if MM_STATS
+/** @brief Counters an arena keeps for mm_stats */
+typedef struct {
+    size_t free_blocks[MM_STATS_BINS]; // free blocks per free list class
+    size_t free_bytes[MM_STATS_BINS];  // bytes in those blocks
+    size_t extends;                    // times the heap grew
+    size_t searches;                   // calls to find_fit
+    size_t search_steps;               // free blocks they examined
+} arena_stats_t;
+#endif
+
+/**
+ * @brief An independent heap with its own segregated free lists.
+ *
+ * The main arena owns the mem_sbrk heap that starts at heap_start. In the
+ * thread-safe build, secondary arenas grow inside their own mem_map
+ * regions (see heap_info_t) and every arena has its own lock.
+ */
+typedef struct arena {
+#if MM_TLSF
+    /** @brief Bit i is set if any list of first level i is non-empty */
+    uint64_t fl_bitmap;
+    /** @brief Bit j of entry i is set if blocks[i][j] is non-empty */
+    uint32_t sl_bitmap[tlsf_fl_count];
+    /** @brief Free lists, indexed by tlsf_mapping */
+    link_t blocks[tlsf_fl_count][tlsf_sl_count];
+#else
+    /**
+     * @brief Segregated free lists, indexed by findIndex. The last entry is
+     * the root of the large-block treap (see tree_insert).
+     */
+    link_t segList[numSegs];
+#endif
+    /** @brief Mini chunks with at least one free slot */
+    mini_chunk_t *mini_chunks;
+#if MM_SLAB
+    /** @brief Slabs with at least one free object, per size class */
+    slab_t *slabs[slab_classes];
+    /** @brief An empty slab kept for the next slab_new, or NULL */
+    slab_t *slab_spare;
+#endif
+    /** @brief Cache colors handed out so far (see next_color) */
+    size_t color;
+#if MM_THREADS
+    /** @brief Protects every block and free list owned by the arena */
+    pthread_mutex_t lock;
+    /**
+     * @brief Lock-free stack of blocks freed by threads using other arenas,
+     * chained through `next` and drained by the next malloc or free that
+     * takes the lock, or by the last user to leave the arena
+     */
+    block_t *remote;
+    /** @brief Threads allocating from the arena, who drain remote */
+    size_t users;
+    /** @brief Newest heap region of a secondary arena, NULL for main */
+    struct heap_info *top;
+#endif
+#if MM_STATS
+    /** @brief Counters for mm_stats */
+    arena_stats_t stats;
+#endif
+} arena_t;
+
 /* Global variables */
 
 /** @brief Pointer to first block in the heap */
 static block_t *heap_start = NULL;
 
-// Points to segment list
-static block_t *segList[numSegs];
+/** @brief Current growth step of the main heap (see MM_GROW_MAX) */
+static size_t grow_step;
+
+/** @brief Allocations from the main arena since its heap last grew */
+static size_t grow_idle;
+
+/** @brief Current MM_LINE_ALIGN threshold, 0 if off (see mm_line_align) */
+static size_t line_align_min = MM_LINE_ALIGN;
+
+#if MM_STATS
+/** @brief Blocks in mem_map regions of their own (see map_alloc) */
+static size_t mapped_blocks;
+
+/** @brief Bytes in those regions */
+static size_t mapped_bytes;
+#endif
+
+/** @brief The main arena, which owns the mem_sbrk heap */
+#if MM_THREADS
+static arena_t main_arena = {.lock = PTHREAD_MUTEX_INITIALIZER};
+#else
+static arena_t main_arena;
+#endif
+
+#if MM_SLAB
+/**
+ * @brief Root of the slab page map, a radix tree indexed by page number
+ * (see slab_of). Inner nodes are heap blocks of pointers to the next
+ * level, and leaves are bitmaps with a bit set for every page that starts
+ * a slab, so the whole map costs a few heap blocks per 16 MiB of slabs.
+ */
+static void *page_map_root[page_map_root_size];
+
+/**
+ * @brief Address of the main heap divided by slab_size. Slabs only live in
+ * the main heap, so page numbers count from there.
+ */
+static uintptr_t page_map_base;
+#endif
+
+#if MM_THREADS
+/**
+ * @brief Size and alignment of every heap region of a secondary arena.
+ *
+ * Because regions are aligned to their size, the heap_info_t of a block
+ * with the arena bit set is found by masking the block address.
+ */
+static const size_t arena_heap_size = (1 << 24);
+
+/** @brief Requests at least this large always use the main arena */
+static const size_t arena_large_size = (1 << 22);
+
+/** @brief Hard upper bound on the number of arenas */
+static const size_t arena_max = 64;
+
+/**
+ * @brief Header at the start of every heap region of a secondary arena.
+ *
+ * The region holds, in order: this header, the arena_t itself (first
+ * region of an arena only), a prologue, the blocks and an epilogue.
+ */
+typedef struct heap_info {
+    arena_t *arena;         // owning arena
+    struct heap_info *prev; // previous, full region of the same arena
+    size_t size;            // bytes in use, through the end of the epilogue
+} heap_info_t;
+
+/** @brief Largest block size (bytes) served from the thread cache */
+static const size_t tcache_max_size = 512;
+
+/** @brief Number of thread cache bins, one per dsize step up to the max */
+static const size_t tcache_bins = 32;
+
+/** @brief Maximum number of blocks held in one thread cache bin */
+static const size_t tcache_count = 16;
+
+/** @brief Number of blocks moved per refill from or flush to segList */
+static const size_t tcache_batch = 8;
+
+/**
+ * @brief Per-thread state: the thread's arena and its cache of free small
+ * blocks.
+ *
+ * Cached blocks stay marked as allocated in the heap, so neighbouring
+ * blocks never coalesce with them. They are chained through their `next`
+ * field, and bin i holds blocks of (i + 1) * dsize bytes, or a little more
+ * for blocks mm_free_sized put there by their requested size.
+ */
+typedef struct {
+    block_t *bins[tcache_bins];
+    size_t counts[tcache_bins];
+    arena_t *arena;  // arena this thread allocates from, NULL if unassigned
+    size_t epoch;    // heap_epoch the state belongs to
+    bool registered; // destructor installed for this thread
+} tcache_t;
+
+#if MM_PERCPU
+/** @brief Maximum number of blocks held in one CPU cache bin */
+static const size_t cpu_cache_slots = 15;
+
+/**
+ * @brief One bin of a CPU cache: a stack of free blocks of one size, kept
+ * like those of a thread cache.
+ *
+ * Pushes and pops are restartable sequences that commit by storing count
+ * (see cpu_cache_pop), so a thread preempted or migrated halfway leaves
+ * the bin as it was.
+ */
+typedef struct {
+    uint64_t count;
+    block_t *slots[cpu_cache_slots];
+} cpu_bin_t;
+
+/**
+ * @brief The CPU caches, tcache_bins bins for each of cpu_cache_cpus CPUs,
+ * in a mem_map region; NULL if there is no rseq area to find the CPU by
+ */
+static cpu_bin_t *cpu_caches;
+
+/** @brief Number of CPUs with a cache */
+static size_t cpu_cache_cpus;
+#endif
+
+/** @brief All arenas; arenas[0] is the main arena */
+static arena_t *arenas[arena_max] = {&main_arena};
+
+/** @brief Number of arenas in use (read without arenas_lock) */
+static size_t narenas = 1;
+
+/** @brief Number of arenas threads are spread over, set on first use */
+static size_t arena_limit = 0;
+
+/** @brief Round-robin cursor for assigning threads to arenas */
+static size_t arena_next = 0;
+
+/** @brief Protects arena creation and assignment */
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Bumped by mm_init so stale per-thread state is dropped */
+static size_t heap_epoch = 0;
+
+static _Thread_local tcache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+#endif
+
+#if MM_PROFILE
+/** @brief Most return addresses kept per sampled allocation */
+static const size_t profile_depth = 32;
+
+/** @brief Number of distinct call stacks the profiler can tell apart */
+static const size_t profile_stack_max = (1 << 13);
+
+/** @brief Number of sampled blocks the profiler can track at once */
+static const size_t profile_sample_max = (1 << 16);
+
+/** @brief Number of hash buckets sampled blocks are looked up in */
+static const size_t profile_bucket_count = (1 << 16);
+
+/**
+ * @brief A call stack that allocated sampled blocks, with the samples it
+ * took. Counts are of samples, not of all allocations: pprof scales them
+ * up by the sampling interval.
+ */
+typedef struct {
+    uint64_t hash;      // hash of frames, to find the stack again
+    size_t depth;       // entries in frames; 0 for an unused slot
+    size_t alloc_objs;  // samples ever taken here
+    size_t alloc_bytes; // bytes requested by those samples
+    size_t live_objs;   // samples not freed yet
+    size_t live_bytes;
+    size_t peak_objs; // live samples when the peak was last recorded
+    size_t peak_bytes;
+    void *frames[profile_depth];
+} profile_stack_t;
+
+/** @brief A sampled block that has not been freed yet */
+typedef struct {
+    void *bp;       // payload pointer
+    size_t size;    // size requested
+    uint32_t stack; // index in profile_stacks
+    uint32_t next;  // next sample in the bucket or unused, plus one; 0 ends
+} profile_sample_t;
+
+/** @brief Per-thread state of the profiler */
+typedef struct {
+    size_t countdown; // bytes to allocate before the next sample; 0 if unset
+    uint64_t rng;     // xorshift state for drawing sample distances
+    bool busy;        // taking a sample, so nested allocations are not
+} profile_thread_t;
+
+/** @brief Mean bytes allocated between samples, or 0 while stopped */
+static size_t profile_interval;
+
+/** @brief Sampling interval of the profile, kept when it stops */
+static size_t profile_rate;
+
+/** @brief Call stacks, an open-addressed table keyed by hash */
+static profile_stack_t *profile_stacks;
+
+/** @brief Sampled blocks, chained from profile_buckets or profile_unused */
+static profile_sample_t *profile_samples;
+
+/** @brief Chains of sampled blocks by payload address; NULL until started */
+static uint32_t *profile_buckets;
+
+/** @brief Chain of freed entries of profile_samples */
+static uint32_t profile_unused;
+
+/** @brief Entries of profile_samples ever used; later ones never were */
+static size_t profile_fresh;
+
+/** @brief Bytes of sampled blocks not freed yet */
+static size_t profile_live_bytes;
+
+/** @brief profile_live_bytes when the peak was last recorded */
+static size_t profile_peak_bytes;
+
+#if MM_THREADS
+/** @brief Protects the profiler's tables */
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local profile_thread_t profile_self;
+#else
+static profile_thread_t profile_self;
+#endif
+#endif
 
 /*
  *****************************************************************************
@@ -153,6 +859,16 @@ static size_t max(size_t x, size_t y) {
     return (x > y) ? x : y;
 }
 
+/**
+ * @brief Returns the minimum of two integers.
+ * @param[in] x
+ * @param[in] y
+ * @return `x` if `x < y`, and `y` otherwise.
+ */
+static size_t min(size_t x, size_t y) {
+    return (x < y) ? x : y;
+}
+
 /**
  * @brief Rounds `size` up to next multiple of n
  * @param[in] size
@@ -178,15 +894,15 @@ static size_t round_up(size_t size, size_t n) {
  */
 static word_t pack(size_t size, bool alloc, bool isPrevAlloc,
                    bool isPrevMiniBlock) {
-    word_t word = size;
+    word_t word = (word_t)size;
     if (alloc) {
         word |= alloc_mask;
     }
     if (isPrevAlloc) {
-        word |= 0x2;
+        word |= prev_alloc_mask;
     }
     if (isPrevMiniBlock) {
-        word |= 0x4;
+        word |= prev_mini_mask;
     }
     return word;
 }
@@ -245,7 +961,7 @@ static void *header_to_payload(block_t *block) {
 static word_t *header_to_footer(block_t *block) {
     dbg_requires(get_size(block) != 0 &&
                  "Called header_to_footer on the epilogue block");
-    return (word_t *)(block->payload + get_size(block) - dsize);
+    return (word_t *)(block->payload + get_size(block) - 2 * wsize);
 }
 
 /**
@@ -295,7 +1011,7 @@ static bool extract_alloc(word_t word) {
  * @return The allocation status correpsonding to the word
  */
 static bool getPrevAlloc(block_t *block) {
-    return (bool)((block->header & 0x2) >> 1);
+    return (bool)((block->header & prev_alloc_mask) >> 1);
 }
 /**
  * @brief Returns the allocation status of previous mini block
@@ -305,7 +1021,7 @@ static bool getPrevAlloc(block_t *block) {
  * @return The allocation status correpsonding to the word
  */
 static bool getPrevMiniBlock(block_t *block) {
-    return (bool)((block->header & 0x4) >> 2);
+    return (bool)((block->header & prev_mini_mask) >> 2);
 }
 /**
  * @brief Returns the allocation status of a block, based on its header.
@@ -319,39 +1035,43 @@ static bool get_alloc(block_t *block) {
 /**
  * @brief Writes an epilogue header at the given address.
  *
- * The epilogue header has size 0, and is marked as allocated.
+ * The epilogue header has size 0, and is marked as allocated. It keeps the
+ * arena bit already present at that address.
  *
  * @param[out] block The location to write the epilogue header
  * @param[in] isPrevAlloc The allocation status of the previous block
  */
 static void write_epilogue(block_t *block, bool isPrev, bool isPrevMiniBlock) {
     dbg_requires(block != NULL);
-    dbg_requires((char *)block == mem_heap_hi() - 7);
-    block->header = pack(0, true, isPrev, isPrevMiniBlock);
+    dbg_requires((block->header & arena_mask) ||
+                 (char *)block == (char *)mem_heap_hi() - (wsize - 1));
+    block->header = pack(0, true, isPrev, isPrevMiniBlock) |
+                    (block->header & arena_mask);
 }
 
 /**
  * @brief Writes a block starting at the given address.
  *
- * This function writes both a header and footer, where the location of the
- * footer is computed in relation to the header.
- *
- * TODO: Are there any preconditions or postconditions?
+ * This function writes the header, and for free blocks larger than a mini
+ * block also a footer. The prev-alloc, prev-mini and arena bits already in
+ * the header are kept.
  *
  * @param[out] block The location to begin writing the block header
  * @param[in] size The size of the new block
  * @param[in] currAlloc The allocation status of the new block
+ * @pre The header at `block` holds valid flag bits.
  */
 static void write_block(block_t *block, size_t size, bool currAlloc) {
     dbg_requires(block != NULL);
     dbg_requires(size > 0);
     bool isPrevAlloc = getPrevAlloc(block);
     bool isPrevMiniBlock = getPrevMiniBlock(block);
-    block->header = pack(size, currAlloc, isPrevAlloc, isPrevMiniBlock);
+    block->header = pack(size, currAlloc, isPrevAlloc, isPrevMiniBlock) |
+                    (block->header & arena_mask);
     if (currAlloc == false) {
-        if (size > min_block_size) {
+        if (size >= min_alloc_size) {
             word_t *footer = header_to_footer(block);
-            *footer = pack(size, currAlloc, isPrevAlloc, isPrevMiniBlock);
+            *footer = block->header;
         }
     }
 }
@@ -386,20 +1106,17 @@ static word_t *find_prev_footer(block_t *block) {
 /**
  * @brief Finds the previous consecutive block on the heap.
  *
- * This is the previous block in the "implicit list" of the heap.
- *
- * If the function is called on the first block in the heap, NULL will be
- * returned, since the first block in the heap has no previous block!
- *
- * The position of the previous block is found by reading the previous
- * block's footer to determine its size, then calculating the start of the
- * previous block based on its size.
+ * This is the previous block in the "implicit list" of the heap. Free
+ * blocks are never mini blocks, so the previous block always has a footer.
  *
  * @param[in] block A block in the heap
- * @return The previous consecutive block in the heap.
+ * @return The previous consecutive block in the heap, or NULL if `block`
+ *         is the first block
+ * @pre The previous block is free.
  */
 static block_t *find_prev(block_t *block) {
     dbg_requires(block != NULL);
+    dbg_requires(!getPrevAlloc(block));
     word_t *footerp = find_prev_footer(block);
 
     // Return NULL if called on first block in the heap
@@ -410,598 +1127,4186 @@ static block_t *find_prev(block_t *block) {
     return footer_to_header(footerp);
 }
 
-/*
- * ---------------------------------------------------------------------------
- *                        END SHORT HELPER FUNCTIONS
- * ---------------------------------------------------------------------------
+/**
+ * @brief Returns the arena bit of a block, to copy into blocks carved out
+ *        of it.
+ * @param[in] block
+ * @return `arena_mask` if the block lives in a secondary arena, else 0
  */
+static word_t get_arena_bit(block_t *block) {
+    return block->header & arena_mask;
+}
+
+/**
+ * @brief Returns whether an allocated block is a mini chunk slot.
+ * @param[in] block
+ * @return true if the block is a mini block
+ */
+static bool is_mini_block(block_t *block) {
+    return !MM_COMPACT && get_size(block) == min_block_size;
+}
+
+/**
+ * @brief Extracts the slot index of a mini block from its header.
+ * @param[in] block a mini block
+ * @return the block's slot in its chunk
+ */
+static size_t mini_slot_index(block_t *block) {
+    word_t word = block->header;
+    return (size_t)(((word >> 1) & 0x7) | ((word >> mini_high_shift) << 3));
+}
+
+/**
+ * @brief Writes the header of an allocated mini block.
+ * @param[out] block the slot
+ * @param[in] index the slot index, below mini_chunk_slots
+ */
+static void write_mini_block(block_t *block, size_t index) {
+    block->header = pack(min_block_size, true, false, false) |
+                    ((word_t)(index & 0x7) << 1) |
+                    ((word_t)(index >> 3) << mini_high_shift);
+}
+
+/**
+ * @brief Returns the chunk a mini block was carved from.
+ * @param[in] block a mini block
+ * @return the chunk
+ */
+static mini_chunk_t *mini_chunk_of(block_t *block) {
+    size_t offset = sizeof(mini_chunk_t) + mini_slot_index(block) * dsize;
+    return (mini_chunk_t *)((char *)block - offset);
+}
+
+/**
+ * @brief Returns a slot of a mini chunk.
+ * @param[in] chunk
+ * @param[in] index the slot index, below mini_chunk_slots
+ * @return the mini block in that slot
+ */
+static block_t *mini_slot(mini_chunk_t *chunk, size_t index) {
+    return (block_t *)((char *)(chunk + 1) + index * dsize);
+}
+
+/**
+ * @brief Returns whether an allocated block owns a mem_map region.
+ * @param[in] block an allocated block
+ * @return true if the block was returned by map_alloc
+ */
+static bool is_mapped(block_t *block) {
+    return !is_mini_block(block) && (block->header & mapped_mask);
+}
+
+#if MM_SLAB
+/**
+ * @brief Returns the page map leaf covering a page, walking the map from
+ * the root: each level takes the next bits of the page number.
+ *
+ * @param[in] page a page number (see page_map_base)
+ * @return the leaf, or NULL if the map has none for the page
+ */
+static uint64_t *page_map_leaf(uintptr_t page) {
+    size_t shift = page_map_depth * page_map_node_bits + page_map_leaf_bits;
+    if ((page >> shift) >= page_map_root_size) {
+        return NULL;
+    }
+    void *node = page_map_root[page >> shift];
+    for (size_t level = 0; level < page_map_depth && node != NULL; level++) {
+        shift -= page_map_node_bits;
+        node = ((void **)node)[(page >> shift) %
+                               ((size_t)1 << page_map_node_bits)];
+    }
+    return (uint64_t *)node;
+}
+
+/**
+ * @brief Returns the index of a page's bit in its page map leaf.
+ * @param[in] page a page number
+ * @return the bit index
+ */
+static size_t page_map_bit(uintptr_t page) {
+    return (size_t)(page % ((uintptr_t)1 << page_map_leaf_bits));
+}
+#endif
+
+/**
+ * @brief Returns the slab an address lies in. A slab starts its page, so
+ * the page map only records which pages hold one.
+ *
+ * @param[in] bp any address, such as a payload pointer
+ * @return the slab, or NULL if bp is not in a slab
+ */
+static slab_t *slab_of(const void *bp) {
+#if MM_SLAB
+    // Addresses below the heap wrap around to pages beyond the map
+    uintptr_t page = (uintptr_t)bp / slab_size - page_map_base;
+    uint64_t *leaf = page_map_leaf(page);
+    size_t bit = page_map_bit(page);
+    if (leaf == NULL || !((leaf[bit / 64] >> (bit % 64)) & 1)) {
+        return NULL;
+    }
+    return (slab_t *)((page + page_map_base) * slab_size);
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * @brief Returns an object of a slab.
+ * @param[in] slab
+ * @param[in] index the object index, below nobjs
+ * @return the object
+ */
+static void *slab_object(slab_t *slab, size_t index) {
+    return (char *)slab + slab->first + index * slab->size;
+}
+
+/**
+ * @brief Returns the index of an object in its slab.
+ * @param[in] slab
+ * @param[in] bp an object of the slab
+ * @return the object index
+ */
+static size_t slab_index(slab_t *slab, void *bp) {
+    size_t offset = (size_t)((char *)bp - (char *)slab_object(slab, 0));
+    // Exact for offsets below slab_size, without dividing
+    return (size_t)(((uint64_t)offset * slab->recip) >> 32);
+}
+
+/**
+ * @brief Returns where the known-zero tail of a free block starts.
+ *
+ * Never-used heap memory (see mem_heap_fresh) and mem_map regions are
+ * zero. A free block with the zero bit keeps, in the word after its free
+ * list links, the offset from which every byte up to its footer is
+ * still zero, so calloc does not have to clear it again.
+ *
+ * @param[in] block a free block
+ * @return the offset of the zero tail, or 0 if none is known
+ */
+static size_t get_clean(block_t *block) {
+    if (!(block->header & zero_mask)) {
+        return 0;
+    }
+    return (size_t)*(word_t *)(block->payload + 2 * sizeof(link_t));
+}
+
+/**
+ * @brief Records the known-zero tail of a free block, in its header,
+ *        footer and the word after its free list links.
+ *
+ * A tail that would leave nothing zero is not recorded.
+ *
+ * @param[in] block a free block whose header and footer are written
+ * @param[in] clean offset of the zero tail, or 0 if none is known
+ */
+static void set_clean(block_t *block, size_t clean) {
+    if (clean == 0 || clean + wsize >= get_size(block)) {
+        return;
+    }
+    dbg_requires(clean >= clean_offset_min);
+    block->header |= zero_mask;
+    *header_to_footer(block) = block->header;
+    *(word_t *)(block->payload + 2 * sizeof(link_t)) = (word_t)clean;
+}
+
+/**
+ * @brief Returns the block a free list or treap link refers to.
+ *
+ * In the compact layout a link is the offset of the block from the heap
+ * prologue, where no block starts, so 0 stands for NULL.
+ *
+ * @param[in] link
+ * @return the block, or NULL
+ */
+static block_t *link_get(link_t link) {
+#if MM_COMPACT
+    if (link == 0) {
+        return NULL;
+    }
+    return (block_t *)((char *)heap_start - wsize + link);
+#else
+    return link;
+#endif
+}
+
+/**
+ * @brief Returns the link that refers to a block.
+ * @param[in] block a block in the heap, or NULL
+ * @return the link
+ */
+static link_t link_make(block_t *block) {
+#if MM_COMPACT
+    if (block == NULL) {
+        return 0;
+    }
+    return (link_t)((char *)block - ((char *)heap_start - wsize));
+#else
+    return block;
+#endif
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                        END SHORT HELPER FUNCTIONS
+ * ---------------------------------------------------------------------------
+ */
+
+/******** The remaining content below are helper and debug routines ********/
+
+/**
+ * @brief Updates the prev-alloc and prev-mini bits of the block after
+ * `block` to match the current state of `block`.
+ *
+ * @param[in] block a block whose size or allocation status just changed
+ */
+static void update_next(block_t *block) {
+    block_t *next = find_next(block);
+    word_t header = next->header & ~(prev_alloc_mask | prev_mini_mask);
+    if (get_alloc(block)) {
+        header |= prev_alloc_mask;
+    }
+    if (get_size(block) == min_block_size) {
+        header |= prev_mini_mask;
+    }
+    next->header = header;
+    if (!get_alloc(next) && get_size(next) >= min_alloc_size) {
+        *header_to_footer(next) = header;
+    }
+}
+
+/**
+ * @brief Counts a block entering or leaving an arena's free lists.
+ *
+ * @param[in] arena
+ * @param[in] bin the block's free list class: its segList index, or its
+ *            TLSF first level
+ * @param[in] size the block size
+ * @param[in] added true if the block was added, false if removed
+ */
+static void stats_count_free(arena_t *arena, size_t bin, size_t size,
+                             bool added) {
+#if MM_STATS
+    if (added) {
+        arena->stats.free_blocks[bin]++;
+        arena->stats.free_bytes[bin] += size;
+    } else {
+        arena->stats.free_blocks[bin]--;
+        arena->stats.free_bytes[bin] -= size;
+    }
+#endif
+}
+
+/**
+ * @brief Counts a fit search of an arena's free lists.
+ * @param[in] arena
+ * @param[in] steps the number of free blocks examined
+ */
+static void stats_count_search(arena_t *arena, size_t steps) {
+#if MM_STATS
+    arena->stats.searches++;
+    arena->stats.search_steps += steps;
+#endif
+}
+
+/**
+ * @brief Counts a mem_map region of a mapped block being mapped or
+ * unmapped. The counters are shared by all threads, without a lock.
+ *
+ * @param[in] size the size of the region
+ * @param[in] added true if the region was mapped, false if unmapped
+ */
+static void stats_count_map(size_t size, bool added) {
+#if MM_STATS && MM_THREADS
+    if (added) {
+        __atomic_fetch_add(&mapped_blocks, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&mapped_bytes, size, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_sub(&mapped_blocks, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&mapped_bytes, size, __ATOMIC_RELAXED);
+    }
+#elif MM_STATS
+    if (added) {
+        mapped_blocks++;
+        mapped_bytes += size;
+    } else {
+        mapped_blocks--;
+        mapped_bytes -= size;
+    }
+#endif
+}
+
+#if MM_PROFILE
+/**
+ * @brief Takes the profiler's lock (a no-op in the single-threaded build)
+ */
+static void profile_lock(void) {
+#if MM_THREADS
+    pthread_mutex_lock(&profile_mutex);
+#endif
+}
+
+/**
+ * @brief Releases the profiler's lock (a no-op in the single-threaded build)
+ */
+static void profile_unlock(void) {
+#if MM_THREADS
+    pthread_mutex_unlock(&profile_mutex);
+#endif
+}
+
+/**
+ * @brief Draws the number of bytes to allocate before the next sample.
+ *
+ * Distances are exponentially distributed with mean profile_interval, so
+ * the sampled bytes form a Poisson process: every byte allocated is as
+ * likely to be sampled as any other, whatever the size of its block, and
+ * pprof can scale the samples back up from the interval alone.
+ *
+ * @param[in] self the calling thread's profiler state
+ * @return the distance in bytes, at least 1
+ */
+static size_t profile_next_sample(profile_thread_t *self) {
+    if (self->rng == 0) {
+        self->rng = (uint64_t)(uintptr_t)self | 1;
+    }
+    // xorshift64*, whose top 53 bits make a uniform double in (0, 1]
+    self->rng ^= self->rng >> 12;
+    self->rng ^= self->rng << 25;
+    self->rng ^= self->rng >> 27;
+    uint64_t bits = (self->rng * UINT64_C(0x2545f4914f6cdd1d)) >> 11;
+    double u = (double)(bits + 1) / (double)(UINT64_C(1) << 53);
+    return (size_t)(-log(u) * (double)profile_interval) + 1;
+}
+
+/**
+ * @brief Hashes a payload pointer to its bucket in profile_buckets
+ * @param[in] bp
+ * @return the bucket index
+ */
+static size_t profile_bucket(void *bp) {
+    uint64_t hash = (uint64_t)(uintptr_t)bp * UINT64_C(0x9e3779b97f4a7c15);
+    return (size_t)(hash >> 32) & (profile_bucket_count - 1);
+}
+
+/**
+ * @brief Maps the profiler's tables the first time a profile starts.
+ *
+ * They come from mem_map rather than malloc, so that taking a sample never
+ * allocates, and untouched entries cost no memory.
+ *
+ * @return true on success
+ * @pre the profiler lock is held
+ */
+static bool profile_map_tables(void) {
+    size_t stacks = profile_stack_max * sizeof(profile_stack_t);
+    size_t samples = profile_sample_max * sizeof(profile_sample_t);
+    size_t buckets = profile_bucket_count * sizeof(uint32_t);
+    char *mem = mem_map(stacks + samples + buckets, 0);
+    if (mem == (void *)-1) {
+        return false;
+    }
+    profile_stacks = (profile_stack_t *)mem;
+    profile_samples = (profile_sample_t *)(mem + stacks);
+    __atomic_store_n(&profile_buckets, (uint32_t *)(mem + stacks + samples),
+                     __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @brief Finds the entry of a call stack, adding it if it is new.
+ *
+ * @param[in] frames return addresses, innermost first
+ * @param[in] depth number of frames, at least 1
+ * @return the index in profile_stacks, or profile_stack_max if the table
+ *         is full
+ * @pre the profiler lock is held
+ */
+static size_t profile_find_stack(void *const *frames, size_t depth) {
+    // FNV-1a over the return addresses
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < depth; i++) {
+        hash = (hash ^ (uint64_t)(uintptr_t)frames[i]) *
+               UINT64_C(0x100000001b3);
+    }
+
+    size_t mask = profile_stack_max - 1;
+    size_t index = (size_t)hash & mask;
+    for (size_t probes = 0; probes < profile_stack_max; probes++) {
+        profile_stack_t *stack = &profile_stacks[index];
+        if (stack->depth == 0) {
+            stack->hash = hash;
+            stack->depth = depth;
+            for (size_t i = 0; i < depth; i++) {
+                stack->frames[i] = frames[i];
+            }
+            return index;
+        }
+        if (stack->hash == hash && stack->depth == depth) {
+            size_t i = 0;
+            while (i < depth && stack->frames[i] == frames[i]) {
+                i++;
+            }
+            if (i == depth) {
+                return index;
+            }
+        }
+        index = (index + 1) & mask;
+    }
+    return profile_stack_max;
+}
+
+/**
+ * @brief Records the live samples of every call stack as the peak ones.
+ * @pre the profiler lock is held
+ */
+static void profile_mark_peak(void) {
+    for (size_t i = 0; i < profile_stack_max; i++) {
+        profile_stack_t *stack = &profile_stacks[i];
+        stack->peak_objs = stack->live_objs;
+        stack->peak_bytes = stack->live_bytes;
+    }
+    profile_peak_bytes = profile_live_bytes;
+}
+
+/**
+ * @brief Records a sampled block with the call stack that allocated it.
+ *
+ * The stack is unwound before the lock is taken, since the first unwind
+ * may load code and allocate. The peak profile is recorded again whenever
+ * the sampled live bytes pass the last peak by a sixteenth, which keeps it
+ * within about 6% of the highest point without copying every stack on
+ * every sample. Samples that find the tables full are dropped.
+ *
+ * @param[in] bp payload pointer of the sampled block
+ * @param[in] size size requested for it
+ */
+static void profile_record(void *bp, size_t size) {
+    void *frames[profile_depth];
+    int depth = backtrace(frames, (int)profile_depth);
+    if (depth <= 0) {
+        return;
+    }
+
+    profile_lock();
+    size_t index = profile_find_stack(frames, (size_t)depth);
+    uint32_t slot = profile_unused;
+    if (slot != 0) {
+        profile_unused = profile_samples[slot - 1].next;
+    } else if (profile_fresh < profile_sample_max) {
+        slot = (uint32_t)++profile_fresh;
+    }
+    if (index < profile_stack_max && slot != 0) {
+        profile_sample_t *sample = &profile_samples[slot - 1];
+        size_t bucket = profile_bucket(bp);
+        sample->bp = bp;
+        sample->size = size;
+        sample->stack = (uint32_t)index;
+        sample->next = profile_buckets[bucket];
+        __atomic_store_n(&profile_buckets[bucket], slot, __ATOMIC_RELAXED);
+
+        profile_stack_t *stack = &profile_stacks[index];
+        stack->alloc_objs++;
+        stack->alloc_bytes += size;
+        stack->live_objs++;
+        stack->live_bytes += size;
+        profile_live_bytes += size;
+        if (profile_live_bytes > profile_peak_bytes + profile_peak_bytes / 16) {
+            profile_mark_peak();
+        }
+    } else if (slot != 0) {
+        profile_samples[slot - 1].next = profile_unused;
+        profile_unused = slot;
+    }
+    profile_unlock();
+}
+
+/**
+ * @brief Stops tracking a sampled block that is being freed, if bp is one.
+ *
+ * @param[in] bp payload pointer of the block
+ * @param[in] bucket profile_bucket(bp)
+ */
+static void profile_forget(void *bp, size_t bucket) {
+    profile_lock();
+    uint32_t *link = &profile_buckets[bucket];
+    while (*link != 0) {
+        uint32_t slot = *link;
+        profile_sample_t *sample = &profile_samples[slot - 1];
+        if (sample->bp == bp) {
+            __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+            profile_stack_t *stack = &profile_stacks[sample->stack];
+            stack->live_objs--;
+            stack->live_bytes -= sample->size;
+            profile_live_bytes -= sample->size;
+            sample->next = profile_unused;
+            profile_unused = slot;
+            break;
+        }
+        link = &sample->next;
+    }
+    profile_unlock();
+}
+#endif
+
+/**
+ * @brief Forgets the profile when mm_init resets the heap, whose mapped
+ * regions held its tables.
+ */
+static void profile_clear(void) {
+#if MM_PROFILE
+    profile_interval = 0;
+    profile_rate = 0;
+    profile_stacks = NULL;
+    profile_samples = NULL;
+    profile_buckets = NULL;
+    profile_unused = 0;
+    profile_fresh = 0;
+    profile_live_bytes = 0;
+    profile_peak_bytes = 0;
+#endif
+}
+
+/**
+ * @brief Counts an allocation towards the next sample of the heap profile.
+ *
+ * Nothing but a load of profile_interval happens unless a profile is being
+ * taken. Otherwise a block is sampled when the bytes allocated by the
+ * calling thread since its last sample reach the drawn distance.
+ *
+ * @param[in] bp payload pointer returned to the caller, or NULL
+ * @param[in] size size requested
+ */
+static void profile_alloc(void *bp, size_t size) {
+#if MM_PROFILE
+    if (__atomic_load_n(&profile_interval, __ATOMIC_RELAXED) == 0 ||
+        bp == NULL) {
+        return;
+    }
+    profile_thread_t *self = &profile_self;
+    if (self->busy) {
+        return;
+    }
+    if (self->countdown == 0) {
+        self->countdown = profile_next_sample(self);
+    }
+    if (size < self->countdown) {
+        self->countdown -= size;
+        return;
+    }
+
+    self->busy = true;
+    profile_record(bp, size);
+    self->countdown = profile_next_sample(self);
+    self->busy = false;
+#endif
+}
+
+/**
+ * @brief Stops tracking a block that is being freed if it was sampled.
+ *
+ * Until a profile has been started this only loads profile_buckets. After
+ * that, the lock is only taken if the block's bucket holds any sample.
+ *
+ * @param[in] bp payload pointer of the block
+ */
+static void profile_free(void *bp) {
+#if MM_PROFILE
+    uint32_t *buckets = __atomic_load_n(&profile_buckets, __ATOMIC_ACQUIRE);
+    if (buckets == NULL) {
+        return;
+    }
+    size_t bucket = profile_bucket(bp);
+    if (__atomic_load_n(&buckets[bucket], __ATOMIC_RELAXED) != 0) {
+        profile_forget(bp, bucket);
+    }
+#endif
+}
+
+#if MM_TLSF
+/**
+ * @brief Maps a block size to its TLSF class.
+ *
+ * The first level is the position of the highest set bit and the second
+ * level the next tlsf_sl_log2 bits below it; small sizes are classed
+ * linearly instead.
+ *
+ * @param[in] size a block size, a multiple of dsize
+ * @param[out] fl the first-level class
+ * @param[out] sl the second-level class
+ */
+static void tlsf_mapping(size_t size, size_t *fl, size_t *sl) {
+    if (size < tlsf_small_size) {
+        *fl = 0;
+        *sl = size / dsize;
+    } else {
+        size_t msb = 63 - (size_t)__builtin_clzll(size);
+        *sl = (size >> (msb - tlsf_sl_log2)) ^ tlsf_sl_count;
+        *fl = msb - tlsf_fl_shift + 1;
+    }
+}
+
+/**
+ * @brief Empties all free lists of an arena
+ *
+ * @param[in] arena
+ */
+static void arena_clear(arena_t *arena) {
+    arena->fl_bitmap = 0;
+    for (size_t i = 0; i < tlsf_fl_count; i++) {
+        arena->sl_bitmap[i] = 0;
+        for (size_t j = 0; j < tlsf_sl_count; j++) {
+            arena->blocks[i][j] = link_make(NULL);
+        }
+    }
+    arena->mini_chunks = NULL;
+#if MM_SLAB
+    for (size_t i = 0; i < slab_classes; i++) {
+        arena->slabs[i] = NULL;
+    }
+    arena->slab_spare = NULL;
+#endif
+    arena->color = 0;
+#if MM_STATS
+    arena->stats = (arena_stats_t){0};
+#endif
+}
+
+/**
+ * @brief removes a free block from its TLSF list, clearing the bitmap
+ * bits of lists that become empty
+ *
+ * @param[in] arena the arena owning the block
+ * @param[in] block the block being removed
+ */
+static void removeFromFree(arena_t *arena, block_t *block) {
+    size_t fl, sl;
+    tlsf_mapping(get_size(block), &fl, &sl);
+    stats_count_free(arena, fl, get_size(block), false);
+    block_t *prev = link_get(block->prev);
+    block_t *next = link_get(block->next);
+    if (next != NULL) {
+        next->prev = block->prev;
+    }
+    if (prev != NULL) {
+        prev->next = block->next;
+    } else {
+        arena->blocks[fl][sl] = block->next;
+        if (next == NULL) {
+            arena->sl_bitmap[fl] &= ~(1u << sl);
+            if (arena->sl_bitmap[fl] == 0) {
+                arena->fl_bitmap &= ~((uint64_t)1 << fl);
+            }
+        }
+    }
+}
+
+/**
+ * @brief adds a free block to the front of its TLSF list
+ *
+ * @param[in] arena the arena owning the block
+ * @param[in] block the block to be added
+ */
+static void addToFree(arena_t *arena, block_t *block) {
+    size_t fl, sl;
+    tlsf_mapping(get_size(block), &fl, &sl);
+    stats_count_free(arena, fl, get_size(block), true);
+    block_t *head = link_get(arena->blocks[fl][sl]);
+    block->prev = link_make(NULL);
+    block->next = link_make(head);
+    if (head != NULL) {
+        head->prev = link_make(block);
+    }
+    arena->blocks[fl][sl] = link_make(block);
+    arena->sl_bitmap[fl] |= 1u << sl;
+    arena->fl_bitmap |= (uint64_t)1 << fl;
+}
+#else
+/**
+ * @brief determines the index the block should be inserted based on the given
+ * size
+ *
+ * @param[in] intended added block size
+ * return the index in the segList the block will go
+ */
+static size_t findIndex(size_t size) {
+    if (size <= min_block_size) {
+        return 0;
+    }
+    for (size_t i = 0; i < numSegs - 1; i++) {
+        size_t target = min_block_size << (i + 1);
+        if (size < target) {
+            return i;
+        }
+    }
+    return numSegs - 1;
+}
+
+/**
+ * @brief Orders the blocks of the large-block treap by size, then address.
+ * @param[in] a
+ * @param[in] b
+ * @return true if a comes before b
+ */
+static bool tree_less(block_t *a, block_t *b) {
+    size_t size_a = get_size(a);
+    size_t size_b = get_size(b);
+    return size_a < size_b || (size_a == size_b && a < b);
+}
+
+/**
+ * @brief Returns the treap priority of a block, a hash of its address.
+ *
+ * Hashing the address keeps the tree balanced in expectation without
+ * storing a priority in the block.
+ *
+ * @param[in] block
+ * @return the priority; parents never have a lower one than their children
+ */
+static uint64_t tree_priority(block_t *block) {
+    return ((uint64_t)(uintptr_t)block >> 4) * 0x9E3779B97F4A7C15;
+}
+
+/**
+ * @brief Splits a treap into the blocks before `key` and the others.
+ * @param[in] root
+ * @param[in] key a block not in the treap
+ * @param[out] left receives the treap of blocks before key
+ * @param[out] right receives the treap of blocks after key
+ */
+static void tree_split(block_t *root, block_t *key, link_t *left,
+                       link_t *right) {
+    while (root != NULL) {
+        if (tree_less(root, key)) {
+            *left = link_make(root);
+            left = &root->child[1];
+            root = link_get(root->child[1]);
+        } else {
+            *right = link_make(root);
+            right = &root->child[0];
+            root = link_get(root->child[0]);
+        }
+    }
+    *left = link_make(NULL);
+    *right = link_make(NULL);
+}
+
+/**
+ * @brief Inserts a free block into the large-block treap.
+ *
+ * The treap is a binary search tree on (size, address) that is also a
+ * max-heap on tree_priority. The block's child pointers take the place of
+ * its free list pointers; both fit in blocks of any size.
+ *
+ * @param[in] link the root of the treap
+ * @param[in] block the block to insert
+ */
+static void tree_insert(link_t *link, block_t *block) {
+    uint64_t priority = tree_priority(block);
+    block_t *node;
+    while ((node = link_get(*link)) != NULL && tree_priority(node) > priority) {
+        link = &node->child[tree_less(node, block)];
+    }
+    tree_split(node, block, &block->child[0], &block->child[1]);
+    *link = link_make(block);
+}
+
+/**
+ * @brief Removes a free block from the large-block treap, merging its
+ * children in its place.
+ *
+ * @param[in] link the root of the treap
+ * @param[in] block a block in the treap, whose size is unchanged since it
+ *            was inserted
+ */
+static void tree_remove(link_t *link, block_t *block) {
+    block_t *node;
+    while ((node = link_get(*link)) != block) {
+        link = &node->child[tree_less(node, block)];
+    }
+    block_t *left = link_get(block->child[0]);
+    block_t *right = link_get(block->child[1]);
+    while (left != NULL && right != NULL) {
+        if (tree_priority(left) > tree_priority(right)) {
+            *link = link_make(left);
+            link = &left->child[1];
+            left = link_get(left->child[1]);
+        } else {
+            *link = link_make(right);
+            link = &right->child[0];
+            right = link_get(right->child[0]);
+        }
+    }
+    *link = link_make((left != NULL) ? left : right);
+}
+
+/**
+ * @brief Finds the best fit in the large-block treap.
+ * @param[in] root
+ * @param[in] asize
+ * @param[in,out] steps incremented for every block examined
+ * @return the smallest block of at least asize bytes, the lowest one if
+ *         several have that size, or NULL if none is large enough
+ */
+static block_t *tree_best_fit(block_t *root, size_t asize, size_t *steps) {
+    block_t *fit = NULL;
+    while (root != NULL) {
+        (*steps)++;
+        if (get_size(root) >= asize) {
+            fit = root;
+            root = link_get(root->child[0]);
+        } else {
+            root = link_get(root->child[1]);
+        }
+    }
+    return fit;
+}
+
+/**
+ * @brief removes a free block from its arena's segList
+ *
+ * @param[in] arena the arena owning the block
+ * @param[in] block the block being removed
+ */
+static void removeFromFree(arena_t *arena, block_t *block) {
+    size_t index = findIndex(get_size(block));
+    link_t *segList = arena->segList;
+    stats_count_free(arena, index, get_size(block), false);
+    if (index == numSegs - 1) {
+        tree_remove(&segList[index], block);
+        return;
+    }
+    block_t *prev = link_get(block->prev);
+    block_t *next = link_get(block->next);
+    if (prev != NULL) {
+        // case 1
+        prev->next = block->next;
+        // case 2
+        if (next != NULL) {
+            next->prev = block->prev;
+        }
+    } else {
+        // case 3
+        segList[index] = block->next;
+        // case 4
+        if (next != NULL) {
+            next->prev = link_make(NULL);
+        }
+    }
+}
+
+/**
+ * @brief adds a free block to its arena's segList
+ *
+ * @param[in] arena the arena owning the block
+ * @param[in] block the block to be added
+ */
+static void addToFree(arena_t *arena, block_t *block) {
+    size_t index = findIndex(get_size(block));
+    link_t *segList = arena->segList;
+    stats_count_free(arena, index, get_size(block), true);
+    if (index == numSegs - 1) {
+        tree_insert(&segList[index], block);
+        return;
+    }
+    block_t *addBlock = link_get(segList[index]);
+    block->prev = link_make(NULL);
+    block->next = segList[index];
+    if (addBlock != NULL) {
+        addBlock->prev = link_make(block);
+    }
+    segList[index] = link_make(block);
+}
+
+/**
+ * @brief Empties all free lists of an arena
+ *
+ * @param[in] arena
+ */
+static void arena_clear(arena_t *arena) {
+    for (size_t i = 0; i < numSegs; i++) {
+        arena->segList[i] = link_make(NULL);
+    }
+    arena->mini_chunks = NULL;
+#if MM_SLAB
+    for (size_t i = 0; i < slab_classes; i++) {
+        arena->slabs[i] = NULL;
+    }
+    arena->slab_spare = NULL;
+#endif
+    arena->color = 0;
+#if MM_STATS
+    arena->stats = (arena_stats_t){0};
+#endif
+}
+#endif /* MM_TLSF */
+
+/**
+ * @brief coalesces a newly freed block with its free neighbours
+ *
+ * The neighbours are taken out of the free lists; the merged block is not
+ * added to them. It keeps the known-zero tail of its last part, if any.
+ *
+ * @param[in] arena the arena owning the block
+ * @param[in] block a block already marked free
+ * @return the merged block
+ */
+static block_t *coalesce_block(arena_t *arena, block_t *block) {
+    size_t size = get_size(block);
+    size_t clean = get_clean(block);
+    block_t *next = find_next(block);
+
+    if (!get_alloc(next)) {
+        removeFromFree(arena, next);
+        size_t next_clean = get_clean(next);
+        clean = (next_clean != 0) ? size + next_clean : 0;
+        size += get_size(next);
+    }
+    if (!getPrevAlloc(block)) {
+        block_t *prev = find_prev(block);
+        removeFromFree(arena, prev);
+        if (clean != 0) {
+            clean += get_size(prev);
+        }
+        size += get_size(prev);
+        block = prev;
+    }
+
+    write_block(block, size, false);
+    set_clean(block, clean);
+    update_next(block);
+    return block;
+}
+
+#if MM_THREADS
+/**
+ * @brief Maps a new heap region for a secondary arena and lays out an
+ * empty heap (prologue and epilogue) in it.
+ *
+ * @param[in] arena the arena to grow, or NULL to create a new arena whose
+ *            arena_t lives at the start of the region
+ * @return the new region, which becomes arena->top, or NULL on failure
+ */
+static heap_info_t *heap_new(arena_t *arena) {
+    void *base = mem_map(arena_heap_size, arena_heap_size);
+    if (base == (void *)-1) {
+        return NULL;
+    }
+
+    heap_info_t *heap = (heap_info_t *)base;
+    size_t offset = round_up(sizeof(heap_info_t), dsize);
+    if (arena == NULL) {
+        arena = (arena_t *)((char *)base + offset);
+        offset += round_up(sizeof(arena_t), dsize);
+        arena_clear(arena);
+        pthread_mutex_init(&arena->lock, NULL);
+        arena->remote = NULL;
+        arena->users = 0;
+        arena->top = NULL;
+    }
+    heap->arena = arena;
+    heap->prev = arena->top;
+    arena->top = heap;
+
+    word_t *start = (word_t *)((char *)base + offset);
+    start[0] = pack(0, true, false, false);              // Prologue
+    start[1] = pack(0, true, true, false) | arena_mask; // Epilogue
+    heap->size = offset + 2 * wsize;
+    return heap;
+}
+
+/**
+ * @brief Returns the arena owning an allocated block.
+ * @param[in] block
+ * @return the owning arena
+ */
+static arena_t *arena_of(block_t *block) {
+    if (is_mini_block(block)) {
+        block = (block_t *)mini_chunk_of(block);
+    }
+    if (get_arena_bit(block)) {
+        uintptr_t mask = ~(uintptr_t)(arena_heap_size - 1);
+        heap_info_t *heap = (heap_info_t *)((uintptr_t)block & mask);
+        return heap->arena;
+    }
+    return &main_arena;
+}
+#else
+/**
+ * @brief Returns the arena owning an allocated block.
+ * @param[in] block
+ * @return the main arena, the only one in the single-threaded build
+ */
+static arena_t *arena_of(block_t *block) {
+    return &main_arena;
+}
+#endif
+
+/**
+ * @brief Grows an arena's heap by `size` bytes, like mem_sbrk.
+ *
+ * The main arena grows with mem_sbrk. A secondary arena grows inside its
+ * newest region and maps a fresh region once that one is full.
+ *
+ * @param[in] arena
+ * @param[in] size bytes to add, a multiple of dsize
+ * @return the old end of the heap (just past the old epilogue), or NULL
+ */
+static void *heap_grow(arena_t *arena, size_t size) {
+#if MM_THREADS
+    if (arena != &main_arena) {
+        heap_info_t *heap = arena->top;
+        if (heap->size + size > arena_heap_size) {
+            heap = heap_new(arena);
+            if (heap == NULL || heap->size + size > arena_heap_size) {
+                return NULL;
+            }
+        }
+        void *bp = (char *)heap + heap->size;
+        heap->size += size;
+        return bp;
+    }
+#endif
+#if MM_COMPACT
+    // Links and headers only reach this far
+    if (size > compact_size_max - mem_heapsize()) {
+        return NULL;
+    }
+#endif
+    void *bp = mem_sbrk((intptr_t)size);
+    if (bp == (void *)-1) {
+        return NULL;
+    }
+    return bp;
+}
+
+/**
+ * @brief Returns the next cache color of an arena: an offset in cache_line
+ * steps that rotates through color_span as new chunks and slabs are laid
+ * out.
+ *
+ * @param[in] arena
+ * @param[in] room the largest offset that may be returned
+ * @return the offset, at most room
+ */
+static size_t next_color(arena_t *arena, size_t room) {
+    size_t colors = min(room, color_span - cache_line) / cache_line + 1;
+    return cache_line * (arena->color++ % colors);
+}
+
+/**
+ * @brief extends length of an arena's heap
+ *
+ * The new free block replaces the old epilogue and is coalesced with a free
+ * block before it. It is not added to the free lists.
+ *
+ * @param[in] arena
+ * @param[in] size
+ * @return the new free block, or NULL if the heap cannot grow
+ */
+static block_t *extend_heap(arena_t *arena, size_t size) {
+    void *bp;
+
+    // Allocate an even number of words to maintain alignment
+    size = round_up(size, dsize);
+    if ((bp = heap_grow(arena, size)) == NULL) {
+        return NULL;
+    }
+#if MM_STATS
+    arena->stats.extends++;
+#endif
+    // Initialize free block header/footer
+    block_t *block = payload_to_header(bp);
+    write_block(block, size, false);
+
+    // Memory the heap has never used is still zero
+    size_t clean = clean_offset_min;
+    char *fresh = mem_heap_fresh();
+    if (arena == &main_arena && fresh > (char *)block) {
+        clean = max(clean, (size_t)(fresh - (char *)block));
+    }
+    set_clean(block, clean);
+
+    // Create new epilogue header
+    block_t *block_next = find_next(block);
+    block_next->header = get_arena_bit(block);
+    write_epilogue(block_next, false, false);
+
+    // Coalesce in case the previous block was free
+    block = coalesce_block(arena, block);
+
+    return block;
+}
+
+/**
+ * @brief Returns how many bytes to grow an arena's heap by when no free
+ * block fits a block of asize bytes.
+ *
+ * At least chunksize. The main heap grows by at least grow_step, which is
+ * adjusted here to how recently the heap last grew (see MM_GROW_MAX). A
+ * cache color is added on top, so that the chunk after this one starts at
+ * a different offset within color_span. When mem_hugepagesize reports
+ * that the main heap is backed by huge pages, it is instead grown to the
+ * next huge page boundary, so that the heap always ends with a whole huge
+ * page.
+ *
+ * @param[in] arena
+ * @param[in] asize adjusted block size
+ * @return the number of bytes to pass to extend_heap
+ */
+static size_t grow_size(arena_t *arena, size_t asize) {
+    size_t size = max(asize, chunksize);
+    if (arena != &main_arena) {
+        return size + next_color(arena, color_span);
+    }
+    size_t brk = mem_heapsize();
+#if MM_GROW_MAX
+    if (grow_idle < grow_idle_max) {
+        grow_step = 2 * grow_step;
+        if (grow_step > MM_GROW_MAX) {
+            grow_step = MM_GROW_MAX;
+        }
+    } else {
+        grow_step = max(grow_step / 2, chunksize);
+    }
+    grow_idle = 0;
+    size_t step = round_up(brk / grow_divisor, dsize);
+    if (step > grow_step) {
+        step = grow_step;
+    }
+    size = max(size, step);
+#endif
+    size_t huge = mem_hugepagesize();
+    if (huge != 0) {
+        return round_up(brk + size, huge) - brk;
+    }
+    return size + next_color(arena, color_span);
+}
+
+/**
+ * @brief splits an allocated block, returning the tail to the free lists
+ *
+ * The tail is coalesced with a free block after it, which only exists when
+ * realloc shrinks a block in place.
+ *
+ * @param[in] arena the arena owning the block
+ * @param[in] block
+ * @param[in] asize
+ * @param[in] clean offset of the block's known-zero tail (see get_clean),
+ *            or 0, so the split-off tail can keep what is still zero
+ * @pre asize>0
+ */
+static void split_block(arena_t *arena, block_t *block, size_t asize,
+                        size_t clean) {
+    dbg_requires(get_alloc(block));
+    size_t size = get_size(block);
+    if ((size - asize) >= min_alloc_size) {
+        write_block(block, asize, true);
+
+        block_t *next = find_next(block);
+        next->header = pack(0, false, true, asize == min_block_size) |
+                       get_arena_bit(block);
+        write_block(next, size - asize, false);
+        if (clean != 0) {
+            set_clean(next, max(clean, asize + clean_offset_min) - asize);
+        }
+        next = coalesce_block(arena, next);
+        addToFree(arena, next);
+    }
+
+    dbg_ensures(get_alloc(block));
+}
+
+#if MM_TLSF
+/**
+ * @brief good fit: finds a free block of at least asize bytes in constant
+ * time
+ *
+ * The head of asize's own class is taken if it is large enough. Otherwise
+ * the bitmaps give the first non-empty class above it, all of whose
+ * blocks fit.
+ *
+ * @param[in] arena
+ * @param[in] asize
+ * @return a free block, or NULL if no class above asize's has one
+ */
+static block_t *find_fit(arena_t *arena, size_t asize) {
+    size_t fl, sl;
+    tlsf_mapping(asize, &fl, &sl);
+    block_t *block = link_get(arena->blocks[fl][sl]);
+    stats_count_search(arena, block != NULL);
+    if (block != NULL && get_size(block) >= asize) {
+        return block;
+    }
+
+    // Look for a non-empty class above (fl, sl)
+    uint32_t sl_map = arena->sl_bitmap[fl] & (~1u << sl);
+    if (sl_map == 0) {
+        uint64_t fl_map = arena->fl_bitmap & (~(uint64_t)1 << fl);
+        if (fl_map == 0) {
+            return NULL; // no fit found
+        }
+        fl = (size_t)__builtin_ctzll(fl_map);
+        sl_map = arena->sl_bitmap[fl];
+    }
+    sl = (size_t)__builtin_ctz(sl_map);
+    return link_get(arena->blocks[fl][sl]);
+}
+#else
+/**
+ * @brief first fit to find a block of the necessary minimum size
+ *
+ * Takes the best of the first five fits in the lists, and the best fit
+ * from the large-block treap.
+ *
+ * @param[in] arena
+ * @param[in] asize
+ * @return
+ */
+static block_t *find_fit(arena_t *arena, size_t asize) {
+    size_t count = 5;
+    block_t *fit_block = NULL;
+    size_t min_fit_size = 0;
+    size_t size = findIndex(asize);
+    size_t steps = 0;
+    for (size_t i = size; i < numSegs - 1; i++) {
+        for (block_t *block = link_get(arena->segList[i]);
+             (block != NULL && count > 0); block = link_get(block->next)) {
+            steps++;
+            if (asize <= get_size(block)) {
+                if (count == 5) {
+                    fit_block = block;
+                    min_fit_size = get_size(fit_block);
+                }
+                if (get_size(block) < min_fit_size) {
+                    fit_block = block;
+                    min_fit_size = get_size(fit_block);
+                }
+                count = count - 1;
+            }
+        }
+        if (fit_block != NULL) {
+            stats_count_search(arena, steps);
+            return fit_block;
+        }
+    }
+
+    fit_block =
+        tree_best_fit(link_get(arena->segList[numSegs - 1]), asize, &steps);
+    stats_count_search(arena, steps);
+    return fit_block;
+}
+#endif /* MM_TLSF */
+
+static bool checkAlignment(block_t *currBlock, int n) {
+    return (uintptr_t)currBlock % 16 == n;
+}
+
+/**
+ * @brief Reports a heap consistency error.
+ *
+ * @param[in] line the line mm_checkheap was called from
+ * @param[in] msg what is wrong
+ * @return false, for use as `return check_error(...)`
+ */
+static bool check_error(int line, const char *msg) {
+    printf("mm_checkheap (line %d): %s\n", line, msg);
+    return false;
+}
+
+/**
+ * @brief Walks one contiguous heap from its first block to its epilogue and
+ * checks every block.
+ *
+ * @param[in] first the block right after the prologue
+ * @param[in] arena_bit the arena bit every block must carry
+ * @param[in] line
+ * @param[out] nfree incremented by the number of free blocks found
+ * @return the epilogue, or NULL if an error was found
+ */
+static block_t *check_blocks(block_t *first, word_t arena_bit, int line,
+                             size_t *nfree) {
+    word_t prologue = *find_prev_footer(first);
+    if (extract_size(prologue) != 0 || !extract_alloc(prologue)) {
+        check_error(line, "bad prologue");
+        return NULL;
+    }
+
+    bool prevAlloc = true;
+    bool prevMini = false;
+    block_t *block = first;
+    for (; get_size(block) != 0; block = find_next(block)) {
+        size_t size = get_size(block);
+        bool alloc = get_alloc(block);
+        if (!checkAlignment(block, (int)(dsize - wsize)) ||
+            size % dsize != 0 || size < min_alloc_size) {
+            check_error(line, "misaligned block or bad block size");
+            return NULL;
+        }
+        if (get_arena_bit(block) != arena_bit) {
+            check_error(line, "block has the wrong arena bit");
+            return NULL;
+        }
+        if (getPrevAlloc(block) != prevAlloc ||
+            getPrevMiniBlock(block) != prevMini) {
+            check_error(line, "prev-alloc or prev-mini bit is stale");
+            return NULL;
+        }
+        if (!alloc) {
+            (*nfree)++;
+            if (!prevAlloc) {
+                check_error(line, "two consecutive free blocks");
+                return NULL;
+            }
+            if (size >= min_alloc_size &&
+                *header_to_footer(block) != block->header) {
+                check_error(line, "header and footer do not match");
+                return NULL;
+            }
+            size_t clean = get_clean(block);
+            if (clean != 0 && (clean < clean_offset_min ||
+                               clean + wsize >= size ||
+                               *(word_t *)((char *)block + clean) != 0 ||
+                               *(header_to_footer(block) - 1) != 0)) {
+                check_error(line, "zero tail of a free block is not zero");
+                return NULL;
+            }
+        } else if (block->header & (zero_mask | mapped_mask)) {
+            check_error(line, "allocated block has the zero or mapped bit");
+            return NULL;
+        }
+        prevAlloc = alloc;
+        prevMini = is_mini_block(block);
+    }
+
+    if (!get_alloc(block) || getPrevAlloc(block) != prevAlloc ||
+        getPrevMiniBlock(block) != prevMini) {
+        check_error(line, "bad epilogue");
+        return NULL;
+    }
+    return block;
+}
+
+/**
+ * @brief Checks the free lists of an arena.
+ *
+ * @param[in] arena
+ * @param[in] line
+ * @param[out] nfree set to the number of blocks in the lists
+ * @return true if every list is consistent
+ */
+#if MM_TLSF
+static bool check_free_lists(arena_t *arena, int line, size_t *nfree) {
+    *nfree = 0;
+    for (size_t i = 0; i < tlsf_fl_count; i++) {
+        bool fl_set = (arena->fl_bitmap >> i) & 1;
+        if (fl_set != (arena->sl_bitmap[i] != 0)) {
+            return check_error(line, "first-level bitmap is stale");
+        }
+        for (size_t j = 0; j < tlsf_sl_count; j++) {
+            block_t *prev = NULL;
+            block_t *block = link_get(arena->blocks[i][j]);
+            bool sl_set = (arena->sl_bitmap[i] >> j) & 1;
+            if (sl_set != (block != NULL)) {
+                return check_error(line, "second-level bitmap is stale");
+            }
+            for (; block != NULL; block = link_get(block->next)) {
+                size_t fl, sl;
+                tlsf_mapping(get_size(block), &fl, &sl);
+                if (get_alloc(block)) {
+                    return check_error(line, "allocated block in a free list");
+                }
+                if (fl != i || sl != j) {
+                    return check_error(line, "free block in the wrong list");
+                }
+                if (link_get(block->prev) != prev) {
+                    return check_error(line, "free list prev pointer is wrong");
+                }
+                prev = block;
+                (*nfree)++;
+            }
+        }
+    }
+    return true;
+}
+#else
+/**
+ * @brief Checks a subtree of the large-block treap.
+ *
+ * @param[in] arena
+ * @param[in] root
+ * @param[in] lo every block must come after this one, unless it is NULL
+ * @param[in] hi every block must come before this one, unless it is NULL
+ * @param[in] line
+ * @param[in,out] nfree incremented for every block in the subtree
+ * @return true if the subtree is ordered and heap-ordered
+ */
+static bool check_tree(arena_t *arena, block_t *root, block_t *lo,
+                       block_t *hi, int line, size_t *nfree) {
+    if (root == NULL) {
+        return true;
+    }
+    if (get_alloc(root)) {
+        return check_error(line, "allocated block in the treap");
+    }
+    if (findIndex(get_size(root)) != numSegs - 1) {
+        return check_error(line, "free block in the wrong list");
+    }
+    if (arena == &main_arena &&
+        ((void *)root < mem_heap_lo() || (void *)root > mem_heap_hi())) {
+        return check_error(line, "free block outside of the heap");
+    }
+    if ((lo != NULL && !tree_less(lo, root)) ||
+        (hi != NULL && !tree_less(root, hi))) {
+        return check_error(line, "treap is out of order");
+    }
+    for (size_t i = 0; i < 2; i++) {
+        block_t *child = link_get(root->child[i]);
+        if (child != NULL && tree_priority(child) > tree_priority(root)) {
+            return check_error(line, "treap priorities are out of order");
+        }
+    }
+    (*nfree)++;
+    return check_tree(arena, link_get(root->child[0]), lo, root, line,
+                      nfree) &&
+           check_tree(arena, link_get(root->child[1]), root, hi, line, nfree);
+}
+
+static bool check_free_lists(arena_t *arena, int line, size_t *nfree) {
+    *nfree = 0;
+    if (!check_tree(arena, link_get(arena->segList[numSegs - 1]), NULL, NULL,
+                    line, nfree)) {
+        return false;
+    }
+    for (size_t i = 0; i < numSegs - 1; i++) {
+        block_t *prev = NULL;
+        for (block_t *block = link_get(arena->segList[i]); block != NULL;
+             block = link_get(block->next)) {
+            if (get_alloc(block)) {
+                return check_error(line, "allocated block in a free list");
+            }
+            if (findIndex(get_size(block)) != i) {
+                return check_error(line, "free block in the wrong list");
+            }
+            if (arena == &main_arena &&
+                ((void *)block < mem_heap_lo() ||
+                 (void *)block > mem_heap_hi())) {
+                return check_error(line, "free block outside of the heap");
+            }
+            if (i != 0 && link_get(block->prev) != prev) {
+                return check_error(line, "free list prev pointer is wrong");
+            }
+            prev = block;
+            (*nfree)++;
+        }
+    }
+    return true;
+}
+#endif /* MM_TLSF */
+
+/**
+ * @brief Checks an arena's list of mini chunks with free slots.
+ *
+ * @param[in] arena
+ * @param[in] line
+ * @return true if the list is consistent
+ */
+static bool check_mini_chunks(arena_t *arena, int line) {
+    size_t size = sizeof(mini_chunk_t) + mini_chunk_slots * dsize;
+    mini_chunk_t *prev = NULL;
+    for (mini_chunk_t *chunk = arena->mini_chunks; chunk != NULL;
+         chunk = chunk->next) {
+        block_t *block = (block_t *)chunk;
+        // heap_alloc keeps a remainder too small to split off
+        if (!get_alloc(block) || get_size(block) < size ||
+            get_size(block) >= size + min_alloc_size) {
+            return check_error(line, "mini chunk is not an allocated chunk");
+        }
+        if (chunk->free_slots == 0) {
+            return check_error(line, "full mini chunk in the chunk list");
+        }
+        if (chunk->prev != prev) {
+            return check_error(line, "mini chunk prev pointer is wrong");
+        }
+        prev = chunk;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks an arena's lists of slabs with free objects against the
+ * page map and the slabs' bitmaps.
+ *
+ * @param[in] arena
+ * @param[in] line
+ * @return true if the lists are consistent
+ */
+static bool check_slabs(arena_t *arena, int line) {
+#if MM_SLAB
+    size_t room = slab_size - wsize - round_up(sizeof(slab_t), dsize);
+    for (size_t i = 0; i < slab_classes; i++) {
+        slab_t *prev = NULL;
+        for (slab_t *slab = arena->slabs[i]; slab != NULL;
+             slab = slab->next) {
+            block_t *block = payload_to_header(slab);
+            if ((uintptr_t)slab % slab_size != 0 || !get_alloc(block) ||
+                get_size(block) != slab_size) {
+                return check_error(line, "slab is not an aligned block");
+            }
+            if (slab_of(slab) != slab) {
+                return check_error(line, "slab is missing from the page map");
+            }
+            if (slab->size != (i + 1) * dsize ||
+                slab->nobjs != room / slab->size) {
+                return check_error(line, "slab is in the wrong class");
+            }
+            if (slab->first % dsize != 0 ||
+                slab->first < round_up(sizeof(slab_t), dsize) ||
+                (size_t)(slab->first + slab->nobjs * slab->size) >
+                    slab_size - wsize) {
+                return check_error(line, "slab objects overrun the slab");
+            }
+            if (slab->prev != prev) {
+                return check_error(line, "slab prev pointer is wrong");
+            }
+            size_t nfree = 0;
+            for (size_t j = 0; j < slab_map_words; j++) {
+                uint64_t map = slab->free_map[j];
+                if (slab->nobjs < 64 * (j + 1)) {
+                    size_t left = (slab->nobjs > 64 * j) ? slab->nobjs - 64 * j
+                                                         : 0;
+                    if ((map >> left) != 0) {
+                        return check_error(line, "slab has too many objects");
+                    }
+                }
+                nfree += (size_t)__builtin_popcountll(map);
+            }
+            if (nfree == 0 || nfree != slab->nfree) {
+                return check_error(line, "slab free count is wrong");
+            }
+            prev = slab;
+        }
+    }
+    slab_t *spare = arena->slab_spare;
+    if (spare != NULL &&
+        (slab_of(spare) != spare || spare->nfree != spare->nobjs)) {
+        return check_error(line, "spare slab is not an empty slab");
+    }
+#endif
+    return true;
+}
+
+/**
+ * @brief Checks an arena's heap and free lists against each other.
+ *
+ * @param[in] arena
+ * @param[in] line
+ * @return true if the arena is consistent
+ */
+static bool check_arena(arena_t *arena, int line) {
+    size_t nfreeHeap = 0;
+    size_t nfreeLists;
+
+    if (arena == &main_arena) {
+        if (heap_start == NULL) {
+            return check_error(line, "heap is not initialized");
+        }
+        if (!checkAlignment((block_t *)mem_heap_lo(), 0)) {
+            return check_error(line, "heap start is misaligned");
+        }
+        block_t *epilogue = check_blocks(heap_start, 0, line, &nfreeHeap);
+        if (epilogue == NULL) {
+            return false;
+        }
+        if ((char *)epilogue != (char *)mem_heap_hi() - (wsize - 1)) {
+            return check_error(line, "epilogue is not at the end of the heap");
+        }
+    }
+#if MM_THREADS
+    for (heap_info_t *heap = arena->top; heap != NULL; heap = heap->prev) {
+        if (heap->arena != arena) {
+            return check_error(line, "heap region has the wrong owner");
+        }
+        size_t offset = round_up(sizeof(heap_info_t), dsize);
+        if (heap->prev == NULL) {
+            offset += round_up(sizeof(arena_t), dsize);
+        }
+        block_t *first = (block_t *)((char *)heap + offset + wsize);
+        block_t *epilogue = check_blocks(first, arena_mask, line, &nfreeHeap);
+        if (epilogue == NULL) {
+            return false;
+        }
+        if ((char *)epilogue + wsize != (char *)heap + heap->size) {
+            return check_error(line, "region size does not match epilogue");
+        }
+    }
+#endif
+
+    if (!check_free_lists(arena, line, &nfreeLists) ||
+        !check_mini_chunks(arena, line) || !check_slabs(arena, line)) {
+        return false;
+    }
+    if (nfreeHeap != nfreeLists) {
+        return check_error(line, "free block count does not match lists");
+    }
+#if MM_STATS
+    size_t nfreeStats = 0;
+    for (size_t i = 0; i < MM_STATS_BINS; i++) {
+        nfreeStats += arena->stats.free_blocks[i];
+    }
+    if (nfreeStats != nfreeLists) {
+        return check_error(line, "free block statistics are stale");
+    }
+#endif
+    return true;
+}
+
+/**
+ * @brief scans the heap and checks it for possible errors
+ *
+ * Every arena is checked: block layout and boundary tags, the prev-alloc
+ * and prev-mini bits, coalescing, and the free lists. Blocks held in
+ * thread caches or remote queues count as allocated. In the thread-safe
+ * build the caller must make sure no other thread is using the allocator.
+ *
+ * @param[in] line
+ * @return true if the heap is consistent
+ */
+bool mm_checkheap(int line) {
+#if MM_THREADS
+    size_t n = __atomic_load_n(&narenas, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < n; i++) {
+        if (!check_arena(arenas[i], line)) {
+            return false;
+        }
+    }
+    return true;
+#else
+    return check_arena(&main_arena, line);
+#endif
+}
+
+#if MM_PERCPU
+/**
+ * @brief Maps empty CPU caches for a new heap, provided glibc registered an
+ * rseq area to find the calling CPU by. Caches of an old heap went away
+ * with it.
+ */
+static void cpu_caches_init(void) {
+    cpu_bin_t *caches = NULL;
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (__rseq_size != 0 && ncpus > 0) {
+        size_t size = (size_t)ncpus * tcache_bins * sizeof(cpu_bin_t);
+        void *region = mem_map(size, cache_line);
+        if (region != (void *)-1) {
+            caches = region;
+            cpu_cache_cpus = (size_t)ncpus;
+        }
+    }
+    __atomic_store_n(&cpu_caches, caches, __ATOMIC_RELEASE);
+}
+#endif
+
+/**
+ * @brief Lays out an empty mem_sbrk heap for the main arena and gives it
+ * an initial free chunk.
+ *
+ * @return true on success
+ */
+static bool main_heap_init(void) {
+    // Create the initial empty heap, ending in the prologue and epilogue
+    word_t *start = (word_t *)(mem_sbrk(dsize));
+
+    if (start == (void *)-1) {
+        return false;
+    }
+    start += dsize / wsize - 2;
+
+    start[0] = pack(0, true, false, false); // Heap prologue (block footer)
+    start[1] = pack(0, true, true, false);  // Heap epilogue (block header)
+
+    // Heap starts with first "block header", currently the epilogue
+    heap_start = (block_t *)&(start[1]);
+#if MM_SLAB
+    page_map_base = (uintptr_t)heap_start / slab_size;
+    for (size_t i = 0; i < page_map_root_size; i++) {
+        page_map_root[i] = NULL;
+    }
+#endif
+
+    arena_clear(&main_arena);
+#if MM_THREADS
+    main_arena.remote = NULL;
+    main_arena.users = 0;
+#endif
+#if MM_PERCPU
+    cpu_caches_init();
+#endif
+    grow_step = chunksize;
+    grow_idle = 0;
+
+    // Extend the empty heap with a free block of chunksize bytes
+    block_t *temp = extend_heap(&main_arena, chunksize);
+    if (temp == NULL) {
+        return false;
+    }
+    addToFree(&main_arena, temp);
+
+    return true;
+}
+
+/**
+ * @brief initializes heap and segList
+ *
+ * Any secondary arenas and cached blocks from a previous heap are
+ * forgotten; their memory went away with mem_reset_brk.
+ *
+ * @return true on success
+ */
+bool mm_init(void) {
+#if MM_THREADS
+    narenas = 1;
+    arena_next = 0;
+    __atomic_store_n(&heap_epoch, heap_epoch + 1, __ATOMIC_RELEASE);
+#endif
+#if MM_STATS
+    mapped_blocks = 0;
+    mapped_bytes = 0;
+#endif
+    profile_clear();
+    return main_heap_init();
+}
+
+/**
+ * @brief Acquires an arena's lock (a no-op in the single-threaded build)
+ * @param[in] arena
+ */
+static void arena_lock(arena_t *arena) {
+#if MM_THREADS
+    pthread_mutex_lock(&arena->lock);
+#endif
+}
+
+/**
+ * @brief Releases an arena's lock (a no-op in the single-threaded build)
+ * @param[in] arena
+ */
+static void arena_unlock(arena_t *arena) {
+#if MM_THREADS
+    pthread_mutex_unlock(&arena->lock);
+#endif
+}
+
+static void heap_free(arena_t *arena, block_t *block);
+
+/**
+ * @brief Gives an arena's spare slab back to the heap.
+ *
+ * @param[in] arena
+ * @return true if the arena had a spare slab
+ * @pre the arena lock is held
+ */
+static bool slab_release(arena_t *arena) {
+#if MM_SLAB
+    slab_t *slab = arena->slab_spare;
+    if (slab == NULL) {
+        return false;
+    }
+    arena->slab_spare = NULL;
+    uintptr_t page = (uintptr_t)slab / slab_size - page_map_base;
+    size_t bit = page_map_bit(page);
+    page_map_leaf(page)[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+    heap_free(arena, payload_to_header(slab));
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Takes a block of at least asize bytes out of an arena's free lists
+ * and marks it allocated, splitting off any excess.
+ *
+ * For a zeroed block, only the part before the free block's known-zero
+ * tail and its old footer are cleared.
+ *
+ * @param[in] arena
+ * @param[in] asize adjusted block size, at least min_alloc_size
+ * @param[in] may_extend whether the heap may grow to satisfy the request
+ * @param[in] zero whether the payload must be zeroed
+ * @return the allocated block, or NULL if none is available
+ * @pre the arena lock is held
+ */
+static block_t *heap_alloc(arena_t *arena, size_t asize, bool may_extend,
+                           bool zero) {
+    size_t extendSize; // Amount to extend heap if no fit is found
+
+    if (arena == &main_arena) {
+        grow_idle++;
+    }
+
+    // Search the free list for a fit, and again with any spare slab freed
+    block_t *currBlock = find_fit(arena, asize);
+    if (currBlock == NULL && slab_release(arena)) {
+        currBlock = find_fit(arena, asize);
+    }
+
+    // If no fit is found, request more memory, and then and place the block
+    if (currBlock == NULL) {
+        if (!may_extend) {
+            return NULL;
+        }
+        // Request at least chunksize, more while the heap keeps growing
+        extendSize = grow_size(arena, asize);
+        currBlock = extend_heap(arena, extendSize);
+        // extend_heap returns an error
+        if (currBlock == NULL) {
+            return NULL;
+        }
+    } else {
+        removeFromFree(arena, currBlock);
+    }
+
+    // The block should be marked as free
+    dbg_assert(!get_alloc(currBlock));
+    size_t size = get_size(currBlock);
+    size_t clean = get_clean(currBlock);
+
+    // Mark block as allocated
+    write_block(currBlock, size, true);
+    update_next(currBlock);
+
+    // Try to split the block if too large
+    split_block(arena, currBlock, asize, clean);
+
+    if (zero) {
+        size_t bsize = get_size(currBlock);
+        size_t dirty = (clean == 0 || clean > bsize) ? bsize : clean;
+        memset(header_to_payload(currBlock), 0, dirty - wsize);
+        if (dirty < bsize) {
+            // Nothing was split off, so the old footer is still ours
+            memset((char *)currBlock + bsize - wsize, 0, wsize);
+        }
+    }
+    return currBlock;
+}
+
+/**
+ * @brief Shrinks the main heap when a large free block ends it.
+ *
+ * All but chunksize bytes of the block are returned with a negative
+ * mem_sbrk, and a new epilogue is written after what is kept. A heap on huge
+ * pages keeps up to the next huge page boundary, so that no huge page is
+ * split. Regions of secondary arenas are never trimmed.
+ *
+ * @param[in] arena the arena owning the block
+ * @param[in] block a coalesced free block, not in the free lists
+ */
+#if MM_TRIM_THRESHOLD
+static void heap_trim(arena_t *arena, block_t *block) {
+    size_t size = get_size(block);
+    if (size < MM_TRIM_THRESHOLD || arena != &main_arena ||
+        get_size(find_next(block)) != 0) {
+        return;
+    }
+    size_t clean = get_clean(block);
+    size_t keep = chunksize;
+    size_t huge = mem_hugepagesize();
+    if (huge != 0) {
+        size_t brk = mem_heapsize();
+        keep = round_up(brk - size + keep, huge) - (brk - size);
+        if (keep >= size) {
+            return;
+        }
+    }
+    size_t release = size - keep;
+    if (mem_sbrk(-(intptr_t)release) == (void *)-1) {
+        return;
+    }
+    write_block(block, keep, false);
+    set_clean(block, clean);
+    grow_step = chunksize;
+
+    block_t *block_next = find_next(block);
+    block_next->header = get_arena_bit(block);
+    write_epilogue(block_next, false, false);
+}
+#endif /* MM_TRIM_THRESHOLD */
+
+/**
+ * @brief Returns an allocated heap block to its arena's free lists,
+ * coalescing it with its free neighbours.
+ *
+ * @param[in] arena the arena owning the block
+ * @param[in] block the block to free
+ * @pre the arena lock is held and block is allocated
+ */
+static void heap_free(arena_t *arena, block_t *block) {
+    size_t size = get_size(block);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+
+    // Mark the block as free
+    write_block(block, size, false);
+
+    // Try to coalesce the block with its neighbors
+    block = coalesce_block(arena, block);
+
+#if MM_TRIM_THRESHOLD
+    // Give a large free block at the end of the heap back to the system
+    heap_trim(arena, block);
+#endif
+
+    // add it to the free segList
+    addToFree(arena, block);
+}
+
+/**
+ * @brief Adds a mini chunk to its arena's list of chunks with a free slot
+ * @param[in] arena
+ * @param[in] chunk
+ */
+static void mini_chunk_link(arena_t *arena, mini_chunk_t *chunk) {
+    chunk->prev = NULL;
+    chunk->next = arena->mini_chunks;
+    if (chunk->next != NULL) {
+        chunk->next->prev = chunk;
+    }
+    arena->mini_chunks = chunk;
+}
+
+/**
+ * @brief Removes a mini chunk from its arena's list of chunks with a free
+ * slot
+ * @param[in] arena
+ * @param[in] chunk
+ */
+static void mini_chunk_unlink(arena_t *arena, mini_chunk_t *chunk) {
+    if (chunk->prev != NULL) {
+        chunk->prev->next = chunk->next;
+    } else {
+        arena->mini_chunks = chunk->next;
+    }
+    if (chunk->next != NULL) {
+        chunk->next->prev = chunk->prev;
+    }
+}
+
+/**
+ * @brief Allocates a mini block from the first chunk with a free slot,
+ * carving a new chunk out of the heap if there is none.
+ *
+ * @param[in] arena
+ * @param[in] may_extend whether the heap may grow for a new chunk
+ * @param[in] zero whether the payload must be zeroed
+ * @return the mini block, or NULL if none is available
+ * @pre the arena lock is held
+ */
+static block_t *mini_alloc(arena_t *arena, bool may_extend, bool zero) {
+    mini_chunk_t *chunk = arena->mini_chunks;
+    if (chunk == NULL) {
+        size_t size = sizeof(mini_chunk_t) + mini_chunk_slots * dsize;
+        chunk = (mini_chunk_t *)heap_alloc(arena, size, may_extend, false);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->free_slots = mini_chunk_empty;
+        mini_chunk_link(arena, chunk);
+    }
+
+    size_t index = (size_t)__builtin_ctz(chunk->free_slots);
+    chunk->free_slots &= chunk->free_slots - 1;
+    if (chunk->free_slots == 0) {
+        mini_chunk_unlink(arena, chunk);
+    }
+
+    block_t *block = mini_slot(chunk, index);
+    write_mini_block(block, index);
+    if (zero) {
+        memset(header_to_payload(block), 0, wsize);
+    }
+    return block;
+}
+
+/**
+ * @brief Frees a mini block. A chunk whose slots are all free goes back to
+ * the heap, unless it is the arena's only chunk with free slots.
+ *
+ * @param[in] arena the arena owning the block's chunk
+ * @param[in] block the mini block
+ * @pre the arena lock is held
+ */
+static void mini_free(arena_t *arena, block_t *block) {
+    mini_chunk_t *chunk = mini_chunk_of(block);
+    if (chunk->free_slots == 0) {
+        mini_chunk_link(arena, chunk);
+    }
+    chunk->free_slots |= (uint32_t)1 << mini_slot_index(block);
+
+    if (chunk->free_slots == mini_chunk_empty &&
+        (chunk->prev != NULL || chunk->next != NULL)) {
+        mini_chunk_unlink(arena, chunk);
+        heap_free(arena, (block_t *)chunk);
+    }
+}
+
+/**
+ * @brief Records a slab in the page map. Inner nodes and leaves on the way
+ * are allocated from the arena's heap as needed, zeroed, and kept until
+ * the heap is reset.
+ *
+ * @param[in] arena
+ * @param[in] slab a slab, at the start of its page
+ * @return false if the slab is beyond the map's range or a node could not
+ *         be allocated
+ * @pre the arena lock is held
+ */
+static bool page_map_set(arena_t *arena, slab_t *slab) {
+#if MM_SLAB
+    uintptr_t page = (uintptr_t)slab / slab_size - page_map_base;
+    size_t shift = page_map_depth * page_map_node_bits + page_map_leaf_bits;
+    if ((page >> shift) >= page_map_root_size) {
+        return false;
+    }
+    void **slot = &page_map_root[page >> shift];
+    for (size_t level = 0; level <= page_map_depth; level++) {
+        if (*slot == NULL) {
+            size_t size = round_up(page_map_node_size + wsize, dsize);
+            block_t *block = heap_alloc(arena, size, true, true);
+            if (block == NULL) {
+                return false;
+            }
+            *slot = header_to_payload(block);
+        }
+        if (level < page_map_depth) {
+            shift -= page_map_node_bits;
+            slot = &((void **)*slot)[(page >> shift) %
+                                     ((size_t)1 << page_map_node_bits)];
+        }
+    }
+    size_t bit = page_map_bit(page);
+    ((uint64_t *)*slot)[bit / 64] |= (uint64_t)1 << (bit % 64);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Adds a slab to its arena's list of slabs of its class with a free
+ * object
+ * @param[in] arena
+ * @param[in] slab
+ */
+static void slab_link(arena_t *arena, slab_t *slab) {
+#if MM_SLAB
+    slab_t **head = &arena->slabs[slab->size / dsize - 1];
+    slab->prev = NULL;
+    slab->next = *head;
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    *head = slab;
+#endif
+}
+
+/**
+ * @brief Removes a slab from its arena's list of slabs of its class with a
+ * free object
+ * @param[in] arena
+ * @param[in] slab
+ */
+static void slab_unlink(arena_t *arena, slab_t *slab) {
+#if MM_SLAB
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        arena->slabs[slab->size / dsize - 1] = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+#endif
+}
+
+static block_t *aligned_alloc_block(arena_t *arena, size_t alignment,
+                                    size_t asize, bool may_extend);
+
+/**
+ * @brief Sets up a new slab for objects of size bytes: the arena's spare
+ * slab if it has one, or else a block carved out of the heap and recorded
+ * in the page map.
+ *
+ * The bytes too few for another object are spent on a cache color: the
+ * objects start up to that many bytes after the slab header, in
+ * cache_line steps (see next_color).
+ *
+ * @param[in] arena
+ * @param[in] size the object size, a multiple of dsize up to slab_max_size
+ * @return the slab, with every object free, or NULL if none is available
+ * @pre the arena lock is held
+ */
+static slab_t *slab_new(arena_t *arena, size_t size) {
+#if MM_SLAB
+    slab_t *slab = arena->slab_spare;
+    arena->slab_spare = NULL;
+    if (slab == NULL) {
+        block_t *block =
+            aligned_alloc_block(arena, slab_size, slab_size, true);
+        if (block == NULL) {
+            return NULL;
+        }
+        slab = (slab_t *)header_to_payload(block);
+        if (!page_map_set(arena, slab)) {
+            heap_free(arena, block);
+            return NULL;
+        }
+    }
+
+    // The objects end where the next block's header starts, and what is
+    // left over at the end colors where they begin
+    size_t room = slab_size - wsize - round_up(sizeof(slab_t), dsize);
+    size_t nobjs = room / size;
+    slab->recip = (uint32_t)((((uint64_t)1 << 32) + size - 1) / size);
+    slab->size = (uint16_t)size;
+    slab->first = (uint16_t)(round_up(sizeof(slab_t), dsize) +
+                             next_color(arena, room - nobjs * size));
+    slab->nobjs = (uint16_t)nobjs;
+    slab->nfree = slab->nobjs;
+    for (size_t i = 0; i < slab_map_words; i++) {
+        size_t left = (slab->nobjs > 64 * i) ? slab->nobjs - 64 * i : 0;
+        slab->free_map[i] = (left >= 64) ? ~(uint64_t)0
+                                         : ((uint64_t)1 << left) - 1;
+    }
+    slab_link(arena, slab);
+    return slab;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * @brief Allocates an object from the first slab of its class with a free
+ * object, carving a new slab out of the heap if there is none.
+ *
+ * @param[in] arena
+ * @param[in] size payload size in bytes, at most slab_max_size
+ * @param[in] zero whether the object must be zeroed
+ * @return the object, or NULL if none is available
+ * @pre the arena lock is held
+ */
+static void *slab_alloc(arena_t *arena, size_t size, bool zero) {
+#if MM_SLAB
+    size_t osize = round_up(size, dsize);
+    slab_t *slab = arena->slabs[osize / dsize - 1];
+    if (slab == NULL) {
+        slab = slab_new(arena, osize);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+
+    size_t word = 0;
+    while (slab->free_map[word] == 0) {
+        word++;
+    }
+    size_t index = 64 * word + (size_t)__builtin_ctzll(slab->free_map[word]);
+    slab->free_map[word] &= slab->free_map[word] - 1;
+    if (--slab->nfree == 0) {
+        slab_unlink(arena, slab);
+    }
+
+    void *bp = slab_object(slab, index);
+    if (zero) {
+        memset(bp, 0, osize);
+    }
+    return bp;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * @brief Frees a slab object. A slab whose objects are all free becomes
+ * its arena's spare slab, and the previous spare goes back to the heap.
+ *
+ * @param[in] arena the arena owning the slab
+ * @param[in] slab the slab holding the object
+ * @param[in] bp the object
+ * @pre the arena lock is held
+ */
+static void slab_free(arena_t *arena, slab_t *slab, void *bp) {
+#if MM_SLAB
+    size_t index = slab_index(slab, bp);
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    dbg_assert(index < slab->nobjs && slab_object(slab, index) == bp);
+    dbg_assert(!(slab->free_map[index / 64] & bit));
+
+    if (slab->nfree == 0) {
+        slab_link(arena, slab);
+    }
+    slab->free_map[index / 64] |= bit;
+    slab->nfree++;
+
+    if (slab->nfree == slab->nobjs) {
+        slab_unlink(arena, slab);
+        slab_release(arena);
+        arena->slab_spare = slab;
+    }
+#endif
+}
+
+/**
+ * @brief Returns the length of the mem_map region holding a mapped block.
+ * @param[in] block a mapped block
+ */
+static size_t map_length(block_t *block) {
+    return get_size(block) + dsize;
+}
+
+/**
+ * @brief Allocates a block in a mem_map region of its own.
+ *
+ * The region starts with map_offset unused bytes so that the payload is
+ * aligned, followed by the block, which spans the rest of the region but its
+ * last wsize bytes, so that the block size stays a multiple of dsize. It
+ * needs no footer or epilogue since it has no neighbours. Mapped memory is
+ * zero.
+ *
+ * @param[in] asize adjusted block size
+ * @return the allocated block, or NULL if no region could be mapped
+ */
+static block_t *map_alloc(size_t asize) {
+    size_t size = round_up(asize + dsize, mem_pagesize());
+#if MM_COMPACT
+    if (size - dsize > compact_size_max) {
+        return NULL;
+    }
+#endif
+    void *base = mem_map(size, dsize);
+    if (base == (void *)-1) {
+        return NULL;
+    }
+    block_t *block = (block_t *)((char *)base + map_offset);
+    block->header = pack(size - dsize, true, true, false) | mapped_mask;
+    stats_count_map(size, true);
+    return block;
+}
+
+/**
+ * @brief Unmaps the region of a block returned by map_alloc.
+ * @param[in] block a mapped block
+ */
+static void map_free(block_t *block) {
+    size_t size = map_length(block);
+    stats_count_map(size, false);
+    mem_unmap((char *)block - map_offset, size);
+}
+
+/**
+ * @brief Resizes the region of a mapped block with mem_remap, which moves
+ * it if it cannot grow in place, without copying the contents.
+ *
+ * @param[in] block a mapped block
+ * @param[in] asize adjusted block size
+ * @return the block, which may have moved, or NULL if the region could not
+ *         be resized, in which case the block is left untouched
+ */
+static block_t *map_resize(block_t *block, size_t asize) {
+    size_t size = round_up(asize + dsize, mem_pagesize());
+    size_t old_size = map_length(block);
+    if (size == old_size) {
+        return block;
+    }
+#if MM_COMPACT
+    if (size - dsize > compact_size_max) {
+        return NULL;
+    }
+#endif
+    void *base = mem_remap((char *)block - map_offset, old_size, size);
+    if (base == (void *)-1) {
+        return NULL;
+    }
+    block = (block_t *)((char *)base + map_offset);
+    block->header = pack(size - dsize, true, true, false) | mapped_mask;
+    stats_count_map(old_size, false);
+    stats_count_map(size, true);
+    return block;
+}
+
+/**
+ * @brief Allocates a block of asize bytes, from a mini chunk or the heap.
+ *
+ * @param[in] arena
+ * @param[in] asize adjusted block size
+ * @param[in] may_extend whether the heap may grow to satisfy the request
+ * @param[in] zero whether the payload must be zeroed
+ * @return the allocated block, or NULL if none is available
+ * @pre the arena lock is held
+ */
+static block_t *alloc_block(arena_t *arena, size_t asize, bool may_extend,
+                            bool zero) {
+    if (!MM_COMPACT && asize == min_block_size) {
+        return mini_alloc(arena, may_extend, zero);
+    }
+    return heap_alloc(arena, asize, may_extend, zero);
+}
+
+/**
+ * @brief Frees a block returned by alloc_block.
+ *
+ * @param[in] arena the arena owning the block
+ * @param[in] block the block to free
+ * @pre the arena lock is held and block is allocated
+ */
+static void free_block(arena_t *arena, block_t *block) {
+    if (is_mini_block(block)) {
+        mini_free(arena, block);
+    } else {
+        heap_free(arena, block);
+    }
+}
+
+#if MM_THREADS
+/**
+ * @brief Maps a block size to its thread cache bin
+ *
+ * @param[in] size block size, at most tcache_max_size
+ * @return the bin index
+ */
+static size_t tcache_index(size_t size) {
+    dbg_requires(size <= tcache_max_size);
+    return size / dsize - 1;
+}
+
+/**
+ * @brief Returns a chain of cached blocks to the free lists of the arenas
+ * that own them, taking each arena's lock once per run of its blocks.
+ *
+ * @param[in] chain blocks linked through `next`, or NULL
+ */
+static void cache_release(block_t *chain) {
+    arena_t *locked = NULL;
+    while (chain != NULL) {
+        block_t *block = chain;
+        chain = block->next;
+
+        arena_t *arena = arena_of(block);
+        if (arena != locked) {
+            if (locked != NULL) {
+                arena_unlock(locked);
+            }
+            arena_lock(arena);
+            locked = arena;
+        }
+        free_block(arena, block);
+    }
+    if (locked != NULL) {
+        arena_unlock(locked);
+    }
+}
+
+/**
+ * @brief Returns up to n blocks from one bin of a thread cache to the free
+ * lists of the arenas that own them.
+ *
+ * @param[in] tc the thread cache
+ * @param[in] idx the bin to flush
+ * @param[in] n maximum number of blocks to flush
+ */
+static void tcache_flush(tcache_t *tc, size_t idx, size_t n) {
+    // Cut the first n blocks off the bin
+    block_t *chain = tc->bins[idx];
+    block_t *last = NULL;
+    while (n > 0 && tc->bins[idx] != NULL) {
+        last = tc->bins[idx];
+        tc->bins[idx] = last->next;
+        tc->counts[idx]--;
+        n--;
+    }
+    if (last == NULL) {
+        return;
+    }
+    last->next = NULL;
+    cache_release(chain);
+}
+
+/**
+ * @brief Moves a thread to another arena, or to none, keeping each arena's
+ * count of users up to date.
+ *
+ * @param[in] tc the thread's state
+ * @param[in] arena the arena the thread allocates from now, or NULL
+ */
+static void tcache_set_arena(tcache_t *tc, arena_t *arena) {
+    if (tc->arena != NULL) {
+        __atomic_sub_fetch(&tc->arena->users, 1, __ATOMIC_RELAXED);
+    }
+    if (arena != NULL) {
+        __atomic_add_fetch(&arena->users, 1, __ATOMIC_RELAXED);
+    }
+    tc->arena = arena;
+}
+
+static void remote_drain(arena_t *arena);
+
+/**
+ * @brief Thread exit hook: gives all of a thread's cached blocks back and
+ * leaves its arena, draining the blocks other threads queued there.
+ *
+ * @param[in] arg the exiting thread's cache
+ */
+static void tcache_release(void *arg) {
+    tcache_t *tc = arg;
+    if (tc->epoch == __atomic_load_n(&heap_epoch, __ATOMIC_ACQUIRE)) {
+        for (size_t i = 0; i < tcache_bins; i++) {
+            tcache_flush(tc, i, tcache_count);
+        }
+        arena_t *arena = tc->arena;
+        if (arena != NULL) {
+            tcache_set_arena(tc, NULL);
+            // Pairs with the fence in remote_push: either the pusher sees
+            // the arena has no users left, or this drain sees its block
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            arena_lock(arena);
+            remote_drain(arena);
+            arena_unlock(arena);
+        }
+    }
+    tc->registered = false;
+}
+
+/**
+ * @brief Creates the key whose destructor flushes exiting threads' caches
+ */
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+/**
+ * @brief Returns the calling thread's state, resetting it first if the heap
+ * has been reinitialized since it was last used.
+ *
+ * @return the thread cache
+ */
+static tcache_t *tcache_self(void) {
+    tcache_t *tc = &tcache;
+    size_t epoch = __atomic_load_n(&heap_epoch, __ATOMIC_ACQUIRE);
+    if (tc->epoch != epoch) {
+        for (size_t i = 0; i < tcache_bins; i++) {
+            tc->bins[i] = NULL;
+            tc->counts[i] = 0;
+        }
+        tc->arena = NULL;
+        tc->epoch = epoch;
+    }
+    if (!tc->registered) {
+        pthread_once(&tcache_once, tcache_key_create);
+        pthread_setspecific(tcache_key, tc);
+        tc->registered = true;
+    }
+    return tc;
+}
+
+#if MM_PERCPU
+/*
+ * The restartable sequences below follow the kernel's rseq ABI. Each
+ * stores the address of its descriptor, a struct rseq_cs in the __rseq_cs
+ * section, in the thread's rseq area, then runs from label 1 to its
+ * single committing store, which ends at label 2. Should the thread be
+ * preempted, migrated or signalled before it gets there, the kernel
+ * resumes it at the abort handler, label 4, which starts over; the
+ * handler must follow the signature glibc registered the area with. The
+ * calling CPU is read from the area's cpu_id, which is -1 (and so beyond
+ * every cache) until the kernel first sets it.
+ */
+
+/** @brief The rseq_cs descriptor of a sequence, at numeric label 3 */
+#define CPU_CACHE_RSEQ_CS                                                      \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                        \
+    ".balign 32\n\t"                                                           \
+    "3:\n\t"                                                                   \
+    ".long 0x0, 0x0\n\t"                                                       \
+    ".quad 1f, (2f - 1f), 4f\n\t"                                              \
+    ".popsection\n\t"
+
+/** @brief The abort handler of a sequence, restarting it at label 0 */
+#define CPU_CACHE_RSEQ_ABORT                                                   \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                               \
+    ".long 0x53053053\n\t"                                                     \
+    "4:\n\t"                                                                   \
+    "jmp 0b\n\t"
+
+/**
+ * @brief Returns the calling thread's rseq area.
+ * @return the area glibc registered with the kernel
+ */
+static struct rseq *rseq_self(void) {
+    char *tp;
+    __asm__("movq %%fs:0, %0" : "=r"(tp));
+    return (struct rseq *)(tp + __rseq_offset);
+}
+
+/**
+ * @brief Pops a block from one bin of the calling CPU's cache.
+ *
+ * @param[in] bin the bin in the first CPU's cache; the caches of the other
+ *            CPUs follow at a stride of tcache_bins bins
+ * @return an allocated block, or NULL if the bin is empty or the CPU has
+ *         no cache
+ */
+static block_t *cpu_cache_pop(cpu_bin_t *bin) {
+    block_t *block;
+    __asm__ __volatile__(CPU_CACHE_RSEQ_CS
+                         "0:\n\t"
+                         "leaq 3b(%%rip), %%rax\n\t"
+                         "movq %%rax, %c[cs](%[rseq])\n\t"
+                         "1:\n\t"
+                         "movl %c[cpu](%[rseq]), %%eax\n\t"
+                         "cmpq %[ncpus], %%rax\n\t"
+                         "jae 5f\n\t"
+                         "imulq %[stride], %%rax\n\t"
+                         "addq %[bin], %%rax\n\t"
+                         "movq (%%rax), %%rcx\n\t"
+                         "testq %%rcx, %%rcx\n\t"
+                         "jz 5f\n\t"
+                         // slots[count - 1] follows the count word
+                         "movq (%%rax, %%rcx, 8), %[block]\n\t"
+                         "decq %%rcx\n\t"
+                         "movq %%rcx, (%%rax)\n\t"
+                         "2:\n\t"
+                         "jmp 6f\n\t" CPU_CACHE_RSEQ_ABORT "5:\n\t"
+                         "xorl %k[block], %k[block]\n\t"
+                         "6:\n\t"
+                         : [block] "=&r"(block)
+                         : [rseq] "r"(rseq_self()), [bin] "r"(bin),
+                           [ncpus] "r"(cpu_cache_cpus),
+                           [stride] "r"(tcache_bins * sizeof(cpu_bin_t)),
+                           [cs] "i"(offsetof(struct rseq, rseq_cs)),
+                           [cpu] "i"(offsetof(struct rseq, cpu_id))
+                         : "rax", "rcx", "memory", "cc");
+    return block;
+}
+
+/**
+ * @brief Pushes a block onto one bin of the calling CPU's cache.
+ *
+ * @param[in] bin the bin in the first CPU's cache (see cpu_cache_pop)
+ * @param[in] block an allocated block
+ * @return true if the block was cached, false if the bin is full or the
+ *         CPU has no cache
+ */
+static bool cpu_cache_push(cpu_bin_t *bin, block_t *block) {
+    uint64_t pushed;
+    __asm__ __volatile__(CPU_CACHE_RSEQ_CS
+                         "0:\n\t"
+                         "leaq 3b(%%rip), %%rax\n\t"
+                         "movq %%rax, %c[cs](%[rseq])\n\t"
+                         "1:\n\t"
+                         "movl %c[cpu](%[rseq]), %%eax\n\t"
+                         "cmpq %[ncpus], %%rax\n\t"
+                         "jae 5f\n\t"
+                         "imulq %[stride], %%rax\n\t"
+                         "addq %[bin], %%rax\n\t"
+                         "movq (%%rax), %%rcx\n\t"
+                         "cmpq %[nslots], %%rcx\n\t"
+                         "jae 5f\n\t"
+                         // slots[count] follows the count word
+                         "movq %[block], 8(%%rax, %%rcx, 8)\n\t"
+                         "incq %%rcx\n\t"
+                         "movq %%rcx, (%%rax)\n\t"
+                         "2:\n\t"
+                         "movl $1, %k[pushed]\n\t"
+                         "jmp 6f\n\t" CPU_CACHE_RSEQ_ABORT "5:\n\t"
+                         "xorl %k[pushed], %k[pushed]\n\t"
+                         "6:\n\t"
+                         : [pushed] "=&r"(pushed)
+                         : [rseq] "r"(rseq_self()), [bin] "r"(bin),
+                           [block] "r"(block), [ncpus] "r"(cpu_cache_cpus),
+                           [stride] "r"(tcache_bins * sizeof(cpu_bin_t)),
+                           [nslots] "r"(cpu_cache_slots),
+                           [cs] "i"(offsetof(struct rseq, rseq_cs)),
+                           [cpu] "i"(offsetof(struct rseq, cpu_id))
+                         : "rax", "rcx", "memory", "cc");
+    return pushed != 0;
+}
+
+/**
+ * @brief Returns the bin of the CPU caches for a block size.
+ *
+ * @param[in] size block size, at most tcache_max_size
+ * @return the bin in the first CPU's cache, or NULL if there are no CPU
+ *         caches and the thread cache is used instead
+ */
+static cpu_bin_t *cpu_cache_bin(size_t size) {
+    cpu_bin_t *caches = __atomic_load_n(&cpu_caches, __ATOMIC_ACQUIRE);
+    return (caches != NULL) ? caches + tcache_index(size) : NULL;
+}
+#endif
+
+/**
+ * @brief Pops a block from the asize bin of the calling CPU's cache, or
+ * else the thread cache.
+ *
+ * @param[in] asize adjusted block size, at most tcache_max_size
+ * @return an allocated block, or NULL if the bin is empty
+ */
+static block_t *tcache_get(size_t asize) {
+#if MM_PERCPU
+    cpu_bin_t *bin = cpu_cache_bin(asize);
+    if (bin != NULL) {
+        return cpu_cache_pop(bin);
+    }
+#endif
+    tcache_t *tc = tcache_self();
+    size_t idx = tcache_index(asize);
+    block_t *block = tc->bins[idx];
+    if (block != NULL) {
+        tc->bins[idx] = block->next;
+        tc->counts[idx]--;
+    }
+    return block;
+}
+
+/**
+ * @brief Moves up to tcache_batch more blocks of asize bytes into the
+ * calling CPU's cache, or else the thread cache, so the next few mallocs
+ * of this size skip the lock. The heap is never extended for this.
+ *
+ * @param[in] arena the arena the blocks are taken from
+ * @param[in] asize adjusted block size, at most tcache_max_size
+ * @pre the arena lock is held
+ */
+static void tcache_fill(arena_t *arena, size_t asize) {
+#if MM_PERCPU
+    cpu_bin_t *bin = cpu_cache_bin(asize);
+    if (bin != NULL) {
+        for (size_t i = 0; i < tcache_batch; i++) {
+            block_t *block = alloc_block(arena, asize, false, false);
+            if (block == NULL) {
+                break;
+            }
+            if (!cpu_cache_push(bin, block)) {
+                free_block(arena, block);
+                break;
+            }
+        }
+        return;
+    }
+#endif
+    tcache_t *tc = tcache_self();
+    size_t idx = tcache_index(asize);
+    for (size_t i = 0; i < tcache_batch && tc->counts[idx] < tcache_count;
+         i++) {
+        block_t *block = alloc_block(arena, asize, false, false);
+        if (block == NULL) {
+            break;
+        }
+        block->next = tc->bins[idx];
+        tc->bins[idx] = block;
+        tc->counts[idx]++;
+    }
+}
+
+/**
+ * @brief Caches a block being freed in the calling CPU's cache, or else
+ * the thread cache, flushing half of the bin back to segList first if it
+ * is full.
+ *
+ * @param[in] block an allocated block
+ * @param[in] size the size of the bin to cache it in, at most the block's
+ * @return true if the block was cached, false if it is too large or the
+ *         CPU has no cache
+ */
+static bool tcache_put(block_t *block, size_t size) {
+    if (size > tcache_max_size) {
+        return false;
+    }
+#if MM_PERCPU
+    cpu_bin_t *bin = cpu_cache_bin(size);
+    if (bin != NULL) {
+        if (cpu_cache_push(bin, block)) {
+            return true;
+        }
+        // Whichever CPU the thread is on now, empty half of its bin
+        block_t *chain = NULL;
+        for (size_t i = 0; i < cpu_cache_slots / 2; i++) {
+            block_t *cached = cpu_cache_pop(bin);
+            if (cached == NULL) {
+                break;
+            }
+            cached->next = chain;
+            chain = cached;
+        }
+        cache_release(chain);
+        return cpu_cache_push(bin, block);
+    }
+#endif
+    tcache_t *tc = tcache_self();
+    size_t idx = tcache_index(size);
+    if (tc->counts[idx] >= tcache_count) {
+        tcache_flush(tc, idx, tcache_count / 2);
+    }
+    block->next = tc->bins[idx];
+    tc->bins[idx] = block;
+    tc->counts[idx]++;
+    return true;
+}
+
+/**
+ * @brief Creates a new secondary arena if the limit allows it.
+ *
+ * @return the new arena, or NULL
+ * @pre arenas_lock is held
+ */
+static arena_t *arena_create(void) {
+    if (narenas >= arena_limit) {
+        return NULL;
+    }
+    heap_info_t *heap = heap_new(NULL);
+    if (heap == NULL) {
+        return NULL;
+    }
+    arenas[narenas] = heap->arena;
+    __atomic_store_n(&narenas, narenas + 1, __ATOMIC_RELEASE);
+    return heap->arena;
+}
+
+/**
+ * @brief Picks the arena for a thread's first allocation, round-robin over
+ * up to two arenas per online CPU, creating arenas as they are first used.
+ *
+ * Only the first thread gets the main arena. The main heap cannot move, so
+ * mem_sbrk may be unable to grow it (mdriver caps it at a fixed size),
+ * while secondary arenas map new regions wherever there is room.
+ *
+ * @return the arena, which is not locked
+ */
+static arena_t *arena_assign(void) {
+    pthread_mutex_lock(&arenas_lock);
+    if (arena_limit == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        arena_limit = (ncpus > 0) ? 2 * (size_t)ncpus : 1;
+        if (arena_limit > arena_max) {
+            arena_limit = arena_max;
+        }
+    }
+    size_t idx = 0;
+    if (arena_next++ > 0 && arena_limit > 1) {
+        idx = 1 + (arena_next - 2) % (arena_limit - 1);
+    }
+    arena_t *arena = (idx < narenas) ? arenas[idx] : arena_create();
+    pthread_mutex_unlock(&arenas_lock);
+    return (arena != NULL) ? arena : &main_arena;
+}
+
+/**
+ * @brief Finds another arena for a thread whose arena is busy: first any
+ * other arena whose lock is free, then a newly created arena, and only
+ * then waits for the busy one.
+ *
+ * @param[in] busy the arena whose lock could not be taken
+ * @return a locked arena
+ */
+static arena_t *arena_contended(arena_t *busy) {
+    size_t n = __atomic_load_n(&narenas, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < n; i++) {
+        arena_t *arena = arenas[i];
+        if (arena != busy && pthread_mutex_trylock(&arena->lock) == 0) {
+            return arena;
+        }
+    }
+
+    pthread_mutex_lock(&arenas_lock);
+    arena_t *arena = arena_create();
+    pthread_mutex_unlock(&arenas_lock);
+    if (arena == NULL) {
+        arena = busy;
+    }
+    arena_lock(arena);
+    return arena;
+}
+
+/**
+ * @brief Hands a block freed by a thread that does not use its arena back
+ * to the owner without taking the owner's lock.
+ *
+ * The block stays marked as allocated until the owner drains its queue.
+ * Any number of threads may push at once; only a lock holder pops. An
+ * arena no thread uses gets no queue, since no malloc would drain it.
+ *
+ * @param[in] arena the arena owning the block
+ * @param[in] block an allocated block
+ * @return false, leaving the block alone, if the arena has no users
+ */
+static bool remote_push(arena_t *arena, block_t *block) {
+    if (__atomic_load_n(&arena->users, __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
+    block_t *head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+    do {
+        block->next = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote, &head, block, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // The last user may have left since, after draining (see tcache_release)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&arena->users, __ATOMIC_RELAXED) == 0) {
+        arena_lock(arena);
+        remote_drain(arena);
+        arena_unlock(arena);
+    }
+    return true;
+}
+
+/**
+ * @brief Frees every block queued on an arena by other threads.
+ *
+ * The whole queue is detached with one exchange, so a concurrent push
+ * either lands in this batch or waits for the next one; popping whole
+ * lists also rules out ABA on the queue head.
+ *
+ * @param[in] arena
+ * @pre the arena lock is held
+ */
+static void remote_drain(arena_t *arena) {
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    block_t *block =
+        __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+    while (block != NULL) {
+        block_t *next = block->next;
+        free_block(arena, block);
+        block = next;
+    }
+}
+#endif /* MM_THREADS */
+
+/**
+ * @brief Locks and returns the arena an allocation of asize bytes should
+ * come from, initializing the main heap on first use.
+ *
+ * In the thread-safe build, small and medium requests use the calling
+ * thread's arena; a thread that finds its arena busy moves to another one.
+ * Large requests always go to the main arena. Blocks other threads freed
+ * into the arena are reclaimed here.
+ *
+ * @param[in] asize adjusted block size
+ * @return a locked arena, or NULL if the heap could not be initialized
+ */
+static arena_t *arena_acquire(size_t asize) {
+    arena_t *arena = &main_arena;
+#if MM_THREADS
+    if (asize < arena_large_size) {
+        tcache_t *tc = tcache_self();
+        if (tc->arena == NULL) {
+            tcache_set_arena(tc, arena_assign());
+        }
+        arena = tc->arena;
+        if (pthread_mutex_trylock(&arena->lock) != 0) {
+            arena = arena_contended(arena);
+            tcache_set_arena(tc, arena);
+        }
+    } else {
+        arena_lock(arena);
+    }
+#else
+    arena_lock(arena);
+#endif
+
+    // Initialize heap if it isn't initialized
+    if (arena == &main_arena && heap_start == NULL && !main_heap_init()) {
+        arena_unlock(arena);
+        return NULL;
+    }
+#if MM_THREADS
+    remote_drain(arena);
+#endif
+    return arena;
+}
+
+/**
+ * @brief Returns whether a request is placed on whole cache lines (see
+ * MM_LINE_ALIGN).
+ *
+ * @param[in] size payload size in bytes
+ * @return true if size is at least the current threshold and the block
+ *         would stay in the heap; mapped blocks have their pages to
+ *         themselves already
+ */
+static bool line_aligned(size_t size) {
+    size_t min_size = __atomic_load_n(&line_align_min, __ATOMIC_RELAXED);
+    if (min_size == 0 || size < min_size || size > SIZE_MAX / 4) {
+        return false;
+    }
+#if MM_MMAP_THRESHOLD
+    return round_up(size, cache_line) + dsize < MM_MMAP_THRESHOLD;
+#else
+    return true;
+#endif
+}
+
+/**
+ * @brief Returns the adjusted size of a line-aligned block: its payload
+ * is rounded up to whole cache lines, so that the next block's header
+ * starts past the last of them.
+ *
+ * @param[in] size payload size in bytes
+ * @return adjusted block size
+ */
+static size_t line_size(size_t size) {
+    return round_up(round_up(size, cache_line) + wsize, dsize);
+}
+
+/**
+ * @brief Allocates a heap block of asize bytes whose payload is aligned to
+ * alignment bytes, from the calling thread's arena or else the main heap.
+ *
+ * @param[in] alignment a power of two greater than dsize
+ * @param[in] asize adjusted block size, at least min_alloc_size
+ * @return the allocated block, or NULL if memory ran out
+ */
+static block_t *aligned_block(size_t alignment, size_t asize) {
+    arena_t *arena = arena_acquire(asize + alignment + min_alloc_size);
+    if (arena == NULL) {
+        return NULL;
+    }
+    dbg_requires(mm_checkheap(__LINE__));
+
+    block_t *block = aligned_alloc_block(arena, alignment, asize, true);
+    if (block == NULL && arena != &main_arena) {
+        // The secondary arena could not grow; fall back to the main heap
+        arena_unlock(arena);
+        arena = &main_arena;
+        arena_lock(arena);
+#if MM_THREADS
+        remote_drain(arena);
+#endif
+        block = aligned_alloc_block(arena, alignment, asize, true);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    arena_unlock(arena);
+    return block;
+}
+
+/**
+ * @brief Allocates a block for malloc and calloc.
+ *
+ * Requests of at least the MM_LINE_ALIGN threshold get whole cache lines.
+ * In the thread-safe build, small requests are first served from the
+ * calling thread's cache without taking any lock. Otherwise they come from
+ * a slab when slabs are built in, and from the heap if no slab can be had.
+ *
+ * @param[in] size payload size in bytes
+ * @param[in] zero whether the payload must be zeroed
+ * @return the payload pointer, or NULL if size is 0 or memory ran out
+ */
+static void *allocate(size_t size, bool zero) {
+    size_t asize; // Adjusted block size
+    block_t *currBlock;
+    void *bp = NULL;
+
+    // Ignore spurious request
+    if (size == 0) {
+        return bp;
+    }
+
+    if (line_aligned(size)) {
+        currBlock = aligned_block(cache_line, line_size(size));
+        if (currBlock != NULL) {
+            bp = header_to_payload(currBlock);
+            if (zero) {
+                memset(bp, 0, size);
+            }
+        }
+        return bp;
+    }
+
+    // Adjust block size to include overhead and to meet alignment requirements
+    asize = max(round_up(size + wsize, dsize), min_block_size);
+
+#if MM_THREADS
+    if (asize <= tcache_max_size) {
+        currBlock = tcache_get(asize);
+        if (currBlock != NULL) {
+            bp = header_to_payload(currBlock);
+            if (zero) {
+                memset(bp, 0, get_payload_size(currBlock));
+            }
+            return bp;
+        }
+    }
+#endif
+
+    arena_t *arena = arena_acquire(asize);
+    if (arena == NULL) {
+        return bp;
+    }
+    dbg_requires(mm_checkheap(__LINE__));
+
+    // Requests that fit a mini block are left to the mini chunks
+    if (MM_SLAB && size <= slab_max_size &&
+        (MM_COMPACT || asize > min_block_size)) {
+        bp = slab_alloc(arena, size, zero);
+        if (bp != NULL) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            arena_unlock(arena);
+            return bp;
+        }
+    }
+
+    bool may_extend = true;
+#if MM_MMAP_THRESHOLD
+    // A large block may reuse free heap memory, but rather than grow the
+    // heap it gets a region of its own, which is already zero
+    may_extend = (asize < MM_MMAP_THRESHOLD);
+#endif
+    currBlock = alloc_block(arena, asize, may_extend, zero);
+#if MM_MMAP_THRESHOLD
+    if (currBlock == NULL && !may_extend) {
+        currBlock = map_alloc(asize);
+        if (currBlock == NULL) {
+            currBlock = alloc_block(arena, asize, true, zero);
+        }
+    }
+#endif
+    if (currBlock == NULL && arena != &main_arena) {
+        // The secondary arena could not grow; fall back to the main heap
+        arena_unlock(arena);
+        arena = &main_arena;
+        arena_lock(arena);
+#if MM_THREADS
+        remote_drain(arena);
+#endif
+        currBlock = alloc_block(arena, asize, true, zero);
+    }
+    if (currBlock != NULL) {
+#if MM_THREADS
+        if (asize <= tcache_max_size) {
+            tcache_fill(arena, asize);
+        }
+#endif
+        bp = header_to_payload(currBlock);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    arena_unlock(arena);
+
+    return bp;
+}
+
+/**
+ * @brief creates a space in memory of the given size
+ *
+ * @param[in] size
+ * @return the payload pointer, or NULL if size is 0 or memory ran out
+ */
+void *malloc(size_t size) {
+    void *bp = allocate(size, false);
+    profile_alloc(bp, size);
+    return bp;
+}
+
+/**
+ * @brief Frees an allocated block.
+ *
+ * A slab object is found through the page map and goes back to its slab.
+ * A block with a mem_map region of its own is unmapped without taking any
+ * lock. Any other block goes back to the arena that owns it. In the
+ * thread-safe build, a block owned by an arena other than the calling
+ * thread's is queued on that arena's remote list without locking it. Other
+ * small blocks go to the calling thread's cache and only reach segList when
+ * the cache bin overflows. Large heap blocks always live in the main arena
+ * and are freed under its lock.
+ *
+ * @param[in] bp payload pointer returned by malloc, or NULL
+ */
+void free(void *bp) {
+    if (bp == NULL) {
+        return;
+    }
+    profile_free(bp);
+
+    slab_t *slab = slab_of(bp);
+    if (slab != NULL) {
+        arena_t *arena = arena_of(payload_to_header(slab));
+        arena_lock(arena);
+        dbg_requires(mm_checkheap(__LINE__));
+        slab_free(arena, slab, bp);
+        dbg_ensures(mm_checkheap(__LINE__));
+        arena_unlock(arena);
+        return;
+    }
+
+    block_t *block = payload_to_header(bp);
+    if (is_mapped(block)) {
+        map_free(block);
+        return;
+    }
+    arena_t *arena = arena_of(block);
+
+#if MM_THREADS
+    // A thread without an arena, or freeing into an arena no thread uses,
+    // frees under the lock: nobody would drain a queued block
+    tcache_t *tc = tcache_self();
+    if (arena != tc->arena) {
+        if (tc->arena != NULL && get_size(block) < arena_large_size &&
+            remote_push(arena, block)) {
+            return;
+        }
+    } else if (tcache_put(block, get_size(block))) {
+        return;
+    }
+#endif
+
+    arena_lock(arena);
+    dbg_requires(mm_checkheap(__LINE__));
+
+#if MM_THREADS
+    remote_drain(arena);
+#endif
+    free_block(arena, block);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    arena_unlock(arena);
+}
 
-/******** The remaining content below are helper and debug routines ********/
 /**
- * @brief determines the index the block should be inserted based on the given
- * size
+ * @brief Frees an allocated block whose requested size the caller knows.
  *
- * @param[in] intended added block size
- * return the index in the segList the block will go
+ * Mini blocks only serve requests that fit one, slabs only requests of up
+ * to slab_max_size bytes, and only requests of at least MM_MMAP_THRESHOLD
+ * bytes get a region of their own, so any other size names a plain heap
+ * block, which goes straight to heap_free without the checks free makes to
+ * pick a path. heap_free still reads the header: boundary tag coalescing
+ * needs the block's own size, which may exceed the requested one by a
+ * remainder too small to split off, and the free list is picked by the
+ * coalesced size. In the thread-safe build, the size picks the cache bin
+ * of a small block instead; the block may be larger than the bin's size.
+ *
+ * @param[in] bp payload pointer returned by malloc, or NULL
+ * @param[in] size the size passed to malloc or realloc for bp
  */
-static size_t findIndex(size_t size) {
-    if (size <= min_block_size) {
-        return 0;
+void mm_free_sized(void *bp, size_t size) {
+    if (bp == NULL) {
+        return;
     }
-    for (size_t i = 0; i < numSegs - 1; i++) {
-        size_t target = min_block_size << (i + 1);
-        if (size < target) {
-            return i;
-        }
+
+    block_t *block = payload_to_header(bp);
+    dbg_assert(size <= mm_usable_size(bp) &&
+               "mm_free_sized: size does not fit the block");
+    if (size > SIZE_MAX - dsize) {
+        free(bp);
+        return;
     }
-    return numSegs - 1;
+
+    // Whatever path made the block, it is at least this large
+    size_t asize = max(round_up(size + wsize, dsize), min_block_size);
+#if MM_THREADS
+    if (asize <= tcache_max_size && arena_of(block) == tcache_self()->arena) {
+        dbg_assert(get_size(block) >= asize && !is_mapped(block) &&
+                   "mm_free_sized: size does not match the block");
+        profile_free(bp);
+        bool cached = tcache_put(block, asize);
+        dbg_assert(cached);
+        return;
+    }
+    free(bp);
+#else
+    bool heap_only = MM_COMPACT || asize > min_block_size;
+    heap_only = heap_only && !(MM_SLAB && size <= slab_max_size);
+#if MM_MMAP_THRESHOLD
+    heap_only = heap_only && asize < MM_MMAP_THRESHOLD;
+#endif
+    if (!heap_only) {
+        free(bp);
+        return;
+    }
+    dbg_assert(slab_of(bp) == NULL && !is_mini_block(block) &&
+               !is_mapped(block) &&
+               "mm_free_sized: size does not match the block");
+    profile_free(bp);
+
+    arena_t *arena = arena_of(block);
+    arena_lock(arena);
+    dbg_requires(mm_checkheap(__LINE__));
+
+    heap_free(arena, block);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    arena_unlock(arena);
+#endif
 }
+
 /**
- * @brief sets prev next to block next
+ * @brief Returns how many bytes of an allocated block the caller may use.
  *
- * @param[in] block block to be reached
- * @param[in] temp counter block to increment
- * @param[in] prev counter that trails temp
+ * This is at least the size requested, and includes the slack left by
+ * rounding the block size up, which may be used without calling realloc.
+ *
+ * @param[in] bp payload pointer returned by malloc, or NULL
+ * @return the payload size of the block, or 0 for NULL
  */
-static void shiftHelper(block_t *block, block_t *temp, block_t *prev) {
-    while (temp != block) {
-        prev = temp;
-        temp = temp->next;
+size_t mm_usable_size(void *bp) {
+    if (bp == NULL) {
+        return 0;
+    }
+    slab_t *slab = slab_of(bp);
+    if (slab != NULL) {
+        return slab->size;
     }
-    prev->next = temp->next;
+    return get_payload_size(payload_to_header(bp));
 }
+
 /**
- * @brief removed a block from the segList at the given index
+ * @brief Resizes an allocated heap block to asize bytes without moving it.
  *
- * @param[in] block the block being removed
- * @param[in] index the index of the block parameter
+ * A block grows into a free successor, and a block at the end of its heap
+ * (possibly followed by a free block) grows by extending the heap. Any
+ * excess, including the tail of a shrinking block, is split off and freed.
  *
+ * @param[in] arena the arena owning the block
+ * @param[in] block an allocated heap block
+ * @param[in] asize adjusted block size, at least min_alloc_size
+ * @return true if the block now has room for asize bytes
+ * @pre the arena lock is held
  */
-static void removeFromFree(block_t *block, size_t index) {
-    block_t *prev = block->prev;
-    block_t *next = block->next;
-    if (block != NULL) {
-        if (index != 0) {
-            if (prev != NULL) {
-                // case 1
-                prev->next = next;
-                // case 2
-                if (next != NULL) {
-                    next->prev = prev;
-                }
-            } else {
-                // case 3
-                segList[index] = next;
-                // case 4
-                if (next != NULL) {
-
-                    segList[index]->prev = NULL;
-                }
+static bool resize_block(arena_t *arena, block_t *block, size_t asize) {
+    size_t size = get_size(block);
+    if (asize > size) {
+        block_t *next = find_next(block);
+        size_t avail = size + (get_alloc(next) ? 0 : get_size(next));
+        if (avail < asize) {
+            block_t *last = get_alloc(next) ? next : find_next(next);
+            if (get_size(last) != 0) {
+                return false;
+            }
+            // extend_heap merges the new space with a free `next`
+            block_t *ext = extend_heap(arena, asize - avail);
+            if (ext == NULL) {
+                return false;
+            }
+            if (ext != next) {
+                // The arena continued in a new region instead
+                addToFree(arena, ext);
+                return false;
             }
         } else {
-            if (block != segList[0]) {
-                block_t *temp = segList[0]->next;
-                block_t *prev = segList[0];
-                shiftHelper(block, temp, prev);
-                return;
+            removeFromFree(arena, next);
+        }
+        write_block(block, size + get_size(next), true);
+        update_next(block);
+    }
+
+    split_block(arena, block, asize, 0);
+    return true;
+}
+
+/**
+ * @brief Changes the size of an allocated block, keeping its contents.
+ *
+ * The block is resized in place when possible (see resize_block); mini
+ * blocks only stay in place for requests that still fit a mini block, and
+ * slab objects for requests of their own size class. A request that gets
+ * whole cache lines (see MM_LINE_ALIGN) stays in place only if the block
+ * starts a line.
+ * Mapped blocks that stay at least MM_MMAP_THRESHOLD bytes are resized
+ * with mem_remap (mremap), which may move them but never copies them.
+ * Otherwise the contents move to a newly allocated block.
+ *
+ * @param[in] ptr payload pointer returned by malloc, or NULL
+ * @param[in] size new payload size in bytes
+ * @return the new payload pointer, or NULL if size is 0 or memory ran out,
+ *         in which case ptr is left untouched
+ */
+void *realloc(void *ptr, size_t size) {
+    block_t *block = payload_to_header(ptr);
+    size_t copysize;
+    void *newptr;
+
+    // If size == 0, then free block and return NULL
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+
+    // Try to resize the block where it is
+    size_t asize = max(round_up(size + wsize, dsize), min_block_size);
+    slab_t *slab = slab_of(ptr);
+    if (slab != NULL) {
+        if (round_up(size, dsize) == slab->size && !line_aligned(size)) {
+            return ptr;
+        }
+    } else if (is_mapped(block)) {
+#if MM_MMAP_THRESHOLD
+        if (asize >= MM_MMAP_THRESHOLD) {
+            block_t *moved = map_resize(block, asize);
+            if (moved != NULL) {
+                // Profiled as a new block, like one that is copied
+                profile_free(ptr);
+                profile_alloc(header_to_payload(moved), size);
+                return header_to_payload(moved);
             }
-            segList[0] = segList[0]->next;
         }
+#endif
+    } else if (is_mini_block(block)) {
+        if (asize == min_block_size) {
+            return ptr;
+        }
+    } else if (!line_aligned(size) || (uintptr_t)ptr % cache_line == 0) {
+        if (line_aligned(size)) {
+            asize = line_size(size);
+        }
+        arena_t *arena = arena_of(block);
+        arena_lock(arena);
+        dbg_requires(mm_checkheap(__LINE__));
+        bool resized = resize_block(arena, block, max(asize, min_alloc_size));
+        dbg_ensures(mm_checkheap(__LINE__));
+        arena_unlock(arena);
+        if (resized) {
+            return ptr;
+        }
+    }
+
+    // Otherwise, proceed with reallocation
+    newptr = malloc(size);
+
+    // If malloc fails, the original block is left untouched
+    if (newptr == NULL) {
+        return NULL;
+    }
+
+    // Copy the old data
+    // gets size of old payload
+    copysize = (slab != NULL) ? slab->size : get_payload_size(block);
+    if (size < copysize) {
+        copysize = size;
     }
+    memcpy(newptr, ptr, copysize);
+
+    // Free the old block
+    free(ptr);
+    return newptr;
 }
 
 /**
- * @brief adds a block at the given index to the segList
+ * @brief Allocates a zeroed array of elements * size bytes.
  *
- * @param[in] block the block to be added
- * @param[in] index the index in which it will be put
+ * Memory the heap has never handed out is already zero, so only the parts
+ * of the block that were used before are cleared (see heap_alloc).
+ *
+ * @param[in] elements number of elements
+ * @param[in] size size of one element in bytes
+ * @return the payload pointer, or NULL if the product is 0, overflows or
+ *         memory ran out
+ */
+void *calloc(size_t elements, size_t size) {
+    size_t asize = elements * size;
+
+    if (elements == 0) {
+        return NULL;
+    }
+    if (asize / elements != size) {
+        // Multiplication overflowed
+        return NULL;
+    }
+
+    void *bp = allocate(asize, true);
+    profile_alloc(bp, asize);
+    return bp;
+}
+
+/**
+ * @brief Returns how far into a block an aligned block would start: 0 if
+ * its payload is aligned already, and otherwise far enough that the
+ * leading fragment can be a free block of its own.
+ *
+ * @param[in] block
+ * @param[in] alignment a power of two greater than dsize
+ * @return the size of the leading fragment
+ */
+static size_t aligned_lead(block_t *block, size_t alignment) {
+    size_t payload = (size_t)header_to_payload(block);
+    size_t lead = round_up(payload, alignment) - payload;
+    if (lead != 0 && lead < min_alloc_size) {
+        lead += alignment;
+    }
+    return lead;
+}
+
+/**
+ * @brief Allocates a heap block of asize bytes whose payload is aligned to
+ * alignment bytes.
+ *
+ * The block that fits asize is taken if it has room at an aligned payload.
+ * Otherwise the free block taken has room for the block at any alignment,
+ * plus a leading fragment of at least min_alloc_size bytes when the payload
+ * is not aligned already. The fragment goes back to the free lists, as does
+ * any excess after the block.
+ *
+ * @param[in] arena
+ * @param[in] alignment a power of two greater than dsize
+ * @param[in] asize adjusted block size, at least min_alloc_size
+ * @param[in] may_extend whether the heap may grow to satisfy the request
+ * @return the allocated block, or NULL if none is available
+ * @pre the arena lock is held
  */
-static void addToFree(block_t *block, size_t index) {
+static block_t *aligned_alloc_block(arena_t *arena, size_t alignment,
+                                    size_t asize, bool may_extend) {
+    // A block that fits asize may already have room at an aligned payload
+    block_t *block = find_fit(arena, asize);
+    if (block != NULL &&
+        aligned_lead(block, alignment) + asize <= get_size(block)) {
+        removeFromFree(arena, block);
+        write_block(block, get_size(block), true);
+        update_next(block);
+    } else {
+        size_t padded = asize + alignment + min_alloc_size - dsize;
+        block = heap_alloc(arena, padded, may_extend, false);
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    size_t lead = aligned_lead(block, alignment);
+    if (lead != 0) {
+        // Give the leading fragment back as a block of its own
+        size_t size = get_size(block);
+        block_t *aligned = (block_t *)((char *)block + lead);
+        write_block(block, lead, true);
+        aligned->header = pack(0, true, true, false) | get_arena_bit(block);
+        write_block(aligned, size - lead, true);
+        heap_free(arena, block);
+        block = aligned;
+    }
+
+    split_block(arena, block, asize, 0);
+    return block;
+}
+
+/**
+ * @brief Allocates size bytes whose address is a multiple of alignment.
+ *
+ * Alignments up to dsize are what malloc gives anyway. Larger ones always
+ * come from the heap, cut out of a free block by aligned_alloc_block, so
+ * they never get a mem_map region of their own.
+ *
+ * @param[in] alignment a power of two
+ * @param[in] size payload size in bytes
+ * @return the payload pointer, or NULL if size is 0 or memory ran out
+ */
+static void *allocate_aligned(size_t alignment, size_t size) {
+    if (alignment <= dsize) {
+        return malloc(size);
+    }
+    if (size == 0 || size > SIZE_MAX / 4 || alignment > SIZE_MAX / 4) {
+        return NULL;
+    }
+
+    size_t asize = max(round_up(size + wsize, dsize), min_alloc_size);
+    block_t *block = aligned_block(alignment, asize);
     if (block == NULL) {
-        return;
+        return NULL;
+    }
+    void *bp = header_to_payload(block);
+    profile_alloc(bp, size);
+    return bp;
+}
+
+/**
+ * @brief Allocates size bytes aligned to alignment bytes.
+ *
+ * @param[in] alignment a power of two
+ * @param[in] size payload size in bytes
+ * @return the payload pointer, or NULL if size is 0, alignment is not a
+ *         power of two or memory ran out
+ */
+void *memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    return allocate_aligned(alignment, size);
+}
+
+/**
+ * @brief Allocates size bytes aligned to alignment bytes (POSIX).
+ *
+ * @param[out] memptr receives the payload pointer, or NULL if size is 0
+ * @param[in] alignment a power of two multiple of sizeof(void *)
+ * @param[in] size payload size in bytes
+ * @return 0 on success, EINVAL for a bad alignment, ENOMEM if memory ran out
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *bp = allocate_aligned(alignment, size);
+    if (bp == NULL && size != 0) {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
+
+/**
+ * @brief Allocates size bytes aligned to alignment bytes (C11).
+ *
+ * @param[in] alignment a power of two
+ * @param[in] size payload size in bytes
+ * @return the payload pointer, or NULL on failure
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+/**
+ * @brief Sets the payload size from which blocks are placed on whole cache
+ * lines (see MM_LINE_ALIGN). Blocks allocated before keep their layout.
+ *
+ * @param[in] min_size the threshold in bytes, or 0 to turn the mode off
+ */
+void mm_line_align(size_t min_size) {
+    __atomic_store_n(&line_align_min, min_size, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Allocates n blocks of size bytes each, cut out of one free block.
+ *
+ * Blocks that belong in the heap are carved from a single block of n times
+ * the adjusted size: the free lists are searched and the block split once,
+ * and the n pieces lie next to each other in the heap, the last one keeping
+ * any excess. Sizes served from mini chunks or mem_map regions, and a batch
+ * the heap cannot hold in one block, are allocated one at a time instead.
+ *
+ * @param[in] size payload size of every block in bytes
+ * @param[in] n number of blocks
+ * @param[out] out receives the n payload pointers
+ * @return the number of blocks allocated, less than n if memory ran out
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+    if (size == 0 || n == 0) {
+        return 0;
+    }
+
+    size_t asize = max(round_up(size + wsize, dsize), min_block_size);
+    bool carve = (asize >= min_alloc_size && n <= SIZE_MAX / asize &&
+                  !line_aligned(size));
+#if MM_MMAP_THRESHOLD
+    carve = carve && asize < MM_MMAP_THRESHOLD;
+#endif
+    block_t *block = NULL;
+    if (carve) {
+        arena_t *arena = arena_acquire(asize * n);
+        if (arena != NULL) {
+            dbg_requires(mm_checkheap(__LINE__));
+            block = heap_alloc(arena, asize * n, true, false);
+            if (block != NULL) {
+                size_t remaining = get_size(block);
+                word_t arena_bit = get_arena_bit(block);
+                for (size_t i = 0; i < n; i++) {
+                    size_t bsize = (i + 1 < n) ? asize : remaining;
+                    if (i == 0) {
+                        write_block(block, bsize, true);
+                    } else {
+                        block->header =
+                            pack(bsize, true, true, false) | arena_bit;
+                    }
+                    out[i] = header_to_payload(block);
+                    remaining -= bsize;
+                    block = (block_t *)((char *)block + bsize);
+                }
+            }
+            dbg_ensures(mm_checkheap(__LINE__));
+            arena_unlock(arena);
+        }
+    }
+    if (block != NULL) {
+        for (size_t i = 0; i < n; i++) {
+            profile_alloc(out[i], size);
+        }
+        return n;
     }
-    block_t *addBlock = segList[index];
-    if (index != 0) {
-        block->prev = NULL;
-        block->next = addBlock;
-        if (addBlock != NULL) {
-            segList[index]->prev = block;
+
+    size_t i;
+    for (i = 0; i < n; i++) {
+        out[i] = malloc(size);
+        if (out[i] == NULL) {
+            break;
         }
-        segList[index] = block;
-    } else {
-        segList[index] = block;
-        segList[index]->next = addBlock;
     }
+    return i;
 }
 
 /**
- * @brief coalesces free adjacent blocks
+ * @brief Orders payload pointers by address, for qsort.
+ * @param[in] a
+ * @param[in] b
+ * @return negative, zero or positive as *a is below, at or above *b
+ */
+static int cmp_payload(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Frees n blocks at once.
  *
- * @param[in] block to be coalesced at
+ * The pointers are sorted by address, which reorders ptrs. Every run of
+ * blocks that lie next to each other in the heap is merged into one block
+ * before it is freed, so a run is coalesced and added to the free lists
+ * once, and each arena is locked once per stretch of its blocks. Slab
+ * objects, mini blocks and mapped blocks are freed one at a time.
+ *
+ * @param[in,out] ptrs payload pointers returned by malloc, or NULL
+ * @param[in] n number of pointers
  */
-static block_t *coalesce_block(block_t *block) {
-    block_t *prev;
-    block_t *next = find_next(block);
-    bool isPrevAlloc = getPrevAlloc(block);
-    bool isNextAlloc = get_alloc(next);
-    if (!isPrevAlloc) {
-        prev = find_prev(block);
+void mm_free_batch(void **ptrs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] != NULL) {
+            profile_free(ptrs[i]);
+        }
     }
-    size_t blockSize = get_size(block);
-    size_t removed;
-    size_t toBeAdded;
-    if (isPrevAlloc) {
-        removed = get_size(next);
-        // case 1
-        if (isNextAlloc) {
-            write_block(block, blockSize, false);
-            write_block(next, get_size(next), true);
-        } else { // case 2
-            toBeAdded = removed + blockSize;
-            removeFromFree(next, findIndex(get_size(next)));
-            write_block(block, toBeAdded, false);
-            write_block(next, toBeAdded, true);
+
+    // Sort before taking a lock, in case qsort itself allocates
+    qsort(ptrs, n, sizeof(void *), cmp_payload);
+
+    arena_t *locked = NULL;
+    size_t i = 0;
+    while (i < n) {
+        if (ptrs[i] == NULL) {
+            i++;
+            continue;
         }
-    } else {
-        removed = get_size(prev);
-        // case 3
-        if (isNextAlloc) {
-            toBeAdded = removed + blockSize;
-        } else { // case 4
-            removed += get_size(next);
-            toBeAdded = removed + blockSize;
-            removeFromFree(next, findIndex(get_size(next)));
-        }
-        removeFromFree(prev, findIndex(get_size(prev)));
-        block = prev;
-        write_block(block, toBeAdded, false);
-        write_block(next, get_size(next), false);
+        void *bp = ptrs[i++];
+        slab_t *slab = slab_of(bp);
+        block_t *block = payload_to_header(bp);
+        if (slab == NULL && is_mapped(block)) {
+            map_free(block);
+            continue;
+        }
+        arena_t *arena =
+            arena_of((slab != NULL) ? payload_to_header(slab) : block);
+        if (arena != locked) {
+            if (locked != NULL) {
+                dbg_ensures(mm_checkheap(__LINE__));
+                arena_unlock(locked);
+            }
+            arena_lock(arena);
+            dbg_requires(mm_checkheap(__LINE__));
+            locked = arena;
+        }
+        if (slab != NULL) {
+            slab_free(arena, slab, bp);
+            continue;
+        }
+        if (is_mini_block(block)) {
+            mini_free(arena, block);
+            continue;
+        }
+
+        // Merge the blocks that follow this one in the heap
+        size_t size = get_size(block);
+        while (i < n && payload_to_header(ptrs[i]) == find_next(block)) {
+            size += get_size(payload_to_header(ptrs[i++]));
+            write_block(block, size, true);
+        }
+        heap_free(arena, block);
+    }
+    if (locked != NULL) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        arena_unlock(locked);
     }
-    return block;
 }
 
 /**
- * @brief extends length of the heap
+ * @brief Allocates a chunk for a region or a pool.
  *
+ * Chunks are ordinary blocks from malloc, so they come from the calling
+ * thread's arena and stay below MM_MMAP_THRESHOLD, unless one is made to
+ * hold a single large block or large pool objects.
  *
- * @param[in] size
- * @return
+ * @param[in] size payload size of the chunk
+ * @param[in] prev the chunk it comes after
+ * @return the chunk, or NULL if memory ran out
  */
-static block_t *extend_heap(size_t size) {
-    void *bp;
+static region_chunk_t *region_chunk_new(size_t size, region_chunk_t *prev) {
+    region_chunk_t *chunk = malloc(size);
+    if (chunk != NULL) {
+        chunk->prev = prev;
+    }
+    return chunk;
+}
 
-    // Allocate an even number of words to maintain alignment
-    size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1) {
+/**
+ * @brief Creates an empty region.
+ *
+ * @return the region, or NULL if memory ran out
+ */
+mm_region_t *mm_region_create(void) {
+    region_chunk_t *chunk = region_chunk_new(region_chunk_size - wsize, NULL);
+    if (chunk == NULL) {
         return NULL;
     }
-    // Initialize free block header/footer
-    block_t *block = payload_to_header(bp);
-    write_block(block, size, false);
+    size_t header = round_up(sizeof(region_chunk_t), dsize);
+    mm_region_t *region = (mm_region_t *)((char *)chunk + header);
+    region->chunks = chunk;
+    region->cursor = (char *)region + round_up(sizeof(mm_region_t), dsize);
+    region->end = (char *)chunk + get_payload_size(payload_to_header(chunk));
+    return region;
+}
 
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_epilogue(block_next, false, false);
+/**
+ * @brief Allocates size bytes from a region.
+ *
+ * The block is cut from the region's current chunk by moving a cursor,
+ * with no header and no free list work. When the chunk is full, a new one
+ * becomes current and the rest of the old one is left unused. A block of
+ * more than a quarter of a chunk gets a chunk of its own instead, so the
+ * current one is not abandoned for it. Blocks cannot be freed on their own;
+ * mm_region_destroy frees them all.
+ *
+ * @param[in] region a region from mm_region_create
+ * @param[in] size payload size in bytes
+ * @return a dsize-aligned pointer, or NULL if size is 0 or memory ran out
+ */
+void *mm_region_alloc(mm_region_t *region, size_t size) {
+    if (size == 0 || size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    size = round_up(size, dsize);
+    if (size <= (size_t)(region->end - region->cursor)) {
+        void *bp = region->cursor;
+        region->cursor += size;
+        return bp;
+    }
 
-    // Coalesce in case the previous block was free
-    block = coalesce_block(block);
+    size_t header = round_up(sizeof(region_chunk_t), dsize);
+    region_chunk_t *chunk;
+    if (size > region_chunk_size / 4) {
+        // Keep the current chunk in front, where its space is still used
+        chunk = region_chunk_new(header + size, region->chunks->prev);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        region->chunks->prev = chunk;
+        return (char *)chunk + header;
+    }
 
-    return block;
+    chunk = region_chunk_new(region_chunk_size - wsize, region->chunks);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    region->chunks = chunk;
+    region->cursor = (char *)chunk + header + size;
+    region->end = (char *)chunk + get_payload_size(payload_to_header(chunk));
+    return (char *)chunk + header;
+}
+
+/**
+ * @brief Frees a region and every block allocated from it, with one free
+ * per chunk however many blocks the chunks hold.
+ *
+ * @param[in] region a region from mm_region_create, or NULL
+ */
+void mm_region_destroy(mm_region_t *region) {
+    if (region == NULL) {
+        return;
+    }
+    // The region itself lives in the oldest chunk, which goes last
+    region_chunk_t *chunk = region->chunks;
+    while (chunk != NULL) {
+        region_chunk_t *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
 }
 
 /**
- * @brief splits a block into an allocated and free section
- *
+ * @brief Creates an empty pool of objects of obj_size bytes.
  *
- * @param[in] block
- * @param[in] asize
- * @pre asize>0
+ * @param[in] obj_size size of every object in bytes
+ * @return the pool, or NULL if obj_size is 0 or too large, or memory ran
+ *         out
  */
-static void split_block(block_t *block, size_t asize) {
-    dbg_requires(get_alloc(block));
-    size_t size = get_size(block);
-    if ((size - asize) >= min_block_size) {
-        // bool isPrevAlloc = getPrevAlloc(block);
-        write_block(block, asize, true);
-
-        block_t *next = find_next(block);
-        next->header = next->header | 0x2;
-        write_block(next, size - asize, false);
-        addToFree(next, findIndex(get_size(next)));
-        next = find_next(next);
-        write_block(next, get_size(next), get_alloc(next));
+mm_pool_t *mm_pool_create(size_t obj_size) {
+    if (obj_size == 0 || obj_size > SIZE_MAX / (4 * pool_chunk_objs)) {
+        return NULL;
     }
-
-    dbg_ensures(get_alloc(block));
+    mm_pool_t *pool = malloc(sizeof(mm_pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->free = NULL;
+    pool->cursor = NULL;
+    pool->end = NULL;
+    pool->chunks = NULL;
+    pool->size = round_up(obj_size, dsize);
+    return pool;
 }
 
 /**
- * @brief first fit to find a block of the necessary minimum size
+ * @brief Gives a pool a new chunk to cut objects from.
  *
+ * A chunk is a region_chunk_size block, or larger if it would hold fewer
+ * than pool_chunk_objs objects. Its objects are cut off one at a time as
+ * they are needed, so none of them is touched before it is allocated.
  *
- * @param[in] asize
- * @return
+ * @param[in] pool
+ * @return true on success
  */
-static block_t *find_fit(size_t asize) {
-    size_t count = 5;
-    block_t *fit_block = NULL;
-    size_t min_fit_size = 0;
-    size_t size = findIndex(asize);
-    for (size_t i = size; i < numSegs; i++) {
-        for (block_t *block = segList[i]; (block != NULL && count > 0);
-             block = block->next) {
-            if (asize <= get_size(block)) {
-                if (count == 5) {
-                    fit_block = block;
-                    min_fit_size = get_size(fit_block);
-                }
-                if (get_size(block) < min_fit_size) {
-                    fit_block = block;
-                    min_fit_size = get_size(fit_block);
-                }
-                count = count - 1;
-            }
-        }
-        if (fit_block != NULL) {
-            return fit_block;
-        }
+static bool pool_grow(mm_pool_t *pool) {
+    size_t header = round_up(sizeof(region_chunk_t), dsize);
+    size_t size = max(region_chunk_size - wsize,
+                      header + pool_chunk_objs * pool->size);
+    region_chunk_t *chunk = region_chunk_new(size, pool->chunks);
+    if (chunk == NULL) {
+        return false;
     }
-
-    return NULL; // no fit found
-}
-static bool checkAlignment(block_t *currBlock, int n) {
-    return (uintptr_t)currBlock % 16 == n;
+    pool->chunks = chunk;
+    pool->cursor = (char *)chunk + header;
+    pool->end = (char *)chunk + get_payload_size(payload_to_header(chunk));
+    return true;
 }
 
 /**
- * @brief scans the heap and checks it for possible errors
+ * @brief Allocates an object from a pool.
  *
+ * The most recently freed object is reused first, while it is likely to
+ * be in the cache. Otherwise the object is cut from the newest chunk.
+ * Objects have no header, and they are aligned to dsize bytes.
  *
- * @param[in] line
- * @return
+ * @param[in] pool a pool from mm_pool_create
+ * @return the object, or NULL if memory ran out
  */
-
-bool mm_checkheap(int line) {
-    // check if heap exists
-    if (heap_start == NULL) {
-        printf("1: Line %d\n", line);
-        return false;
-    }
-    int numFreeHeap = 0;
-    int numFreeSegList = 0;
-    // check for prologue
-    void *firstHeapByte = mem_heap_lo();
-    block_t *prologue = (block_t *)(char *)(firstHeapByte);
-    bool pAllocTrue = get_alloc(prologue);
-    size_t prologueSize = get_size(prologue);
-    // prologue validity check
-
-    if (prologueSize > 0 || pAllocTrue == false) {
-        printf("2: Line %d\n", line);
-        return false;
+void *mm_pool_alloc(mm_pool_t *pool) {
+    pool_object_t *obj = pool->free;
+    if (obj != NULL) {
+        pool->free = obj->next;
+        return obj;
     }
-    // alignment
-    if (!checkAlignment(prologue, 0)) {
-        printf("3: Line %d\n", line);
-        return false;
+    if ((size_t)(pool->end - pool->cursor) < pool->size && !pool_grow(pool)) {
+        return NULL;
     }
+    obj = (pool_object_t *)pool->cursor;
+    pool->cursor += pool->size;
+    return obj;
+}
 
-    // check for epilogue
-    void *lastHeapByte = mem_heap_hi();
-    char *charLastHeapByte = (char *)lastHeapByte;
-    block_t *epilogue = (block_t *)(charLastHeapByte - wsize + 1);
-    bool eAllocTrue = get_alloc(epilogue);
-    size_t epilogueSize = get_size(epilogue);
-    // epilogue validity check
-    if (epilogueSize > 0 || eAllocTrue == false) {
-        printf("4: Line %d\n", line);
-        return false;
-    }
-    // alignment
-    if (!checkAlignment(epilogue, 8)) {
-        printf("5: Line %d\n", line);
-        return false;
+/**
+ * @brief Returns an object to its pool's free list. Its memory stays with
+ * the pool until the pool is destroyed.
+ *
+ * @param[in] pool the pool obj was allocated from
+ * @param[in] obj an object from mm_pool_alloc, or NULL
+ */
+void mm_pool_free(mm_pool_t *pool, void *obj) {
+    if (obj == NULL) {
+        return;
     }
+    dbg_assert((size_t)obj % dsize == 0 && "mm_pool_free: not a pool object");
+    pool_object_t *node = obj;
+    node->next = pool->free;
+    pool->free = node;
+}
 
-    // iterate through heap
-    for (block_t *currBlock = heap_start; currBlock != epilogue;
-         currBlock = find_next(currBlock)) {
-        if (get_alloc(currBlock) == false) {
-            numFreeHeap++;
-        }
-        // each block address alignment
-        if (!checkAlignment(currBlock, 8)) {
-            printf("6: Line %d\n", line);
-            return false;
-        }
-        // heap boundaries
-        if (currBlock < heap_start || currBlock > epilogue) {
-            printf("7: Line %d\n", line);
-            return false;
-        }
-        // header and footer match
-        if (currBlock->header != *header_to_footer(currBlock)) {
-            printf("8: Line %d\n", line);
-            return false;
-        }
-        // no two free blocks in a row
-        if (!get_alloc(currBlock)) {
-            if (!get_alloc(find_next(currBlock))) {
-                printf("9: Line %d\n", line);
-                return false;
-            }
-            if (find_prev(currBlock) != NULL) {
-                if (get_alloc(find_prev(currBlock))) {
-                    printf("10: Line %d\n", line);
-                    return false;
-                }
-            }
-        }
-        // pointer consistency
-        bool goodPointer = true;
-        if (!get_alloc(currBlock)) {
-            if (currBlock->next != NULL) {
-                goodPointer = (currBlock->next->prev == currBlock);
-            }
-        }
-        if (goodPointer == false) {
-            printf("11: Line %d\n", line);
-            return false;
-        }
+/**
+ * @brief Frees a pool with all its chunks, and so every object allocated
+ * from it, whether or not it was freed.
+ *
+ * @param[in] pool a pool from mm_pool_create, or NULL
+ */
+void mm_pool_destroy(mm_pool_t *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    region_chunk_t *chunk = pool->chunks;
+    while (chunk != NULL) {
+        region_chunk_t *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
     }
+    free(pool);
+}
 
-    // iterate through segment list
-    for (size_t i = 0; i < numSegs; i++) {
-        block_t *currBlock = segList[i];
-        // heap boundaries
-        if (currBlock < heap_start || currBlock > epilogue) {
-            printf("13: Line %d\n", line);
-            return false;
-        }
-        // pointer consistency
-        bool goodPointerSeg = true;
-        if (!get_alloc(currBlock)) {
-            if (currBlock->next != NULL) {
-                goodPointerSeg = (currBlock->next->prev == currBlock);
-            }
+/**
+ * @brief Reports the allocator's statistics.
+ *
+ * Each arena is locked in turn while its counters are read, so the totals
+ * of a thread-safe heap in use are only approximately consistent. Blocks
+ * in thread caches, remote queues and free mini chunk slots count as
+ * allocated.
+ *
+ * @param[out] stats receives the statistics, or zeros if MM_STATS is 0
+ * @return true if the statistics are available
+ */
+bool mm_stats(mm_stats_t *stats) {
+    *stats = (mm_stats_t){0};
+#if MM_STATS
+#if MM_TLSF
+    stats->nbins = tlsf_fl_count;
+#else
+    stats->nbins = numSegs;
+#endif
+#if MM_THREADS
+    size_t n = __atomic_load_n(&narenas, __ATOMIC_ACQUIRE);
+#else
+    size_t n = 1;
+#endif
+    for (size_t i = 0; i < n; i++) {
+#if MM_THREADS
+        arena_t *arena = arenas[i];
+#else
+        arena_t *arena = &main_arena;
+#endif
+        arena_lock(arena);
+        if (arena == &main_arena) {
+            stats->arena += (heap_start != NULL) ? mem_heapsize() : 0;
         }
-        if (goodPointerSeg == false) {
-            printf("14: Line %d\n", line);
-            return false;
+#if MM_THREADS
+        for (heap_info_t *heap = arena->top; heap != NULL; heap = heap->prev) {
+            stats->arena += heap->size;
         }
-        if (!get_alloc(currBlock)) {
-            numFreeSegList++;
+#endif
+        for (size_t bin = 0; bin < stats->nbins; bin++) {
+            stats->bin_blocks[bin] += arena->stats.free_blocks[bin];
+            stats->bin_bytes[bin] += arena->stats.free_bytes[bin];
+            stats->ordblks += arena->stats.free_blocks[bin];
+            stats->fordblks += arena->stats.free_bytes[bin];
         }
+        stats->extends += arena->stats.extends;
+        stats->searches += arena->stats.searches;
+        stats->search_steps += arena->stats.search_steps;
+        arena_unlock(arena);
     }
-
-    // Match free in both lists
-    if (numFreeSegList != numFreeHeap) {
-        printf("15: Line %d\n", line);
-        return false;
-    }
+    stats->uordblks = stats->arena - stats->fordblks;
+#if MM_THREADS
+    stats->hblks = __atomic_load_n(&mapped_blocks, __ATOMIC_RELAXED);
+    stats->hblkhd = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+#else
+    stats->hblks = mapped_blocks;
+    stats->hblkhd = mapped_bytes;
+#endif
     return true;
+#else
+    return false;
+#endif
 }
 
 /**
- * @brief initializes heap and segList
+ * @brief Starts sampling allocations for the heap profile.
  *
+ * About one block per interval bytes allocated is sampled (see
+ * profile_next_sample), with the call stack that allocated it, and tracked
+ * until it is freed. Starting again after mm_profile_stop keeps what was
+ * recorded so far. In the driver, mm_init forgets the profile.
  *
- * @return
+ * @param[in] interval mean number of bytes allocated between samples
+ * @return true on success, false if interval is 0 or too large, or the
+ *         profiler's tables could not be mapped
  */
-bool mm_init(void) {
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
-
-    if (start == (void *)-1) {
+bool mm_profile_start(size_t interval) {
+#if MM_PROFILE
+    if (interval == 0 || interval > SIZE_MAX / 64) {
         return false;
     }
 
-    start[0] = pack(0, true, false, false); // Heap prologue (block footer)
-    start[1] = pack(0, true, true, false);  // Heap epilogue (block header)
-
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
-
-    for (size_t i = 0; i < numSegs; i++) {
-        segList[i] = NULL;
-    }
+    // The first unwind may load code and allocate, so get it over with
+    void *frame;
+    profile_self.busy = true;
+    backtrace(&frame, 1);
+    profile_self.busy = false;
 
-    // Extend the empty heap with a free block of chunksize bytes
-    block_t *temp = extend_heap(chunksize);
-    if (temp == NULL) {
+    profile_lock();
+    if (profile_buckets == NULL && !profile_map_tables()) {
+        profile_unlock();
         return false;
     }
-    addToFree(temp, findIndex(get_size(temp)));
-    block_t *next = find_next(temp);
-    write_block(next, get_size(next), get_alloc(next));
-
+    profile_rate = interval;
+    __atomic_store_n(&profile_interval, interval, __ATOMIC_RELAXED);
+    profile_unlock();
     return true;
+#else
+    return false;
+#endif
 }
 
 /**
- * @brief creates a space in memory of the given size
- *
- *
- * @param[in] size
- * @return
+ * @brief Stops sampling allocations. Blocks sampled already are still
+ * tracked until they are freed, so the live profile stays accurate.
  */
-void *malloc(size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
-
-    size_t asize;      // Adjusted block size
-    size_t extendSize; // Amount to extend heap if no fit is found
-    block_t *currBlock;
-    void *bp = NULL;
-
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        mm_init();
-    }
-
-    // Ignore spurious request
-    if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
-    }
-
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = max(round_up(size + wsize, dsize), min_block_size);
+void mm_profile_stop(void) {
+#if MM_PROFILE
+    __atomic_store_n(&profile_interval, 0, __ATOMIC_RELAXED);
+#endif
+}
 
-    // Search the free list for a fit
-    currBlock = find_fit(asize);
+#if MM_PROFILE
+/** @brief A buffer of profile text on its way to a file */
+typedef struct {
+    int fd;
+    size_t len;
+    bool ok; // no write failed
+    char buf[4096];
+} profile_out_t;
 
-    // If no fit is found, request more memory, and then and place the block
-    if (currBlock == NULL) {
-        // Always request at least chunksize
-        extendSize = max(asize, chunksize);
-        block_t *temp = extend_heap(extendSize);
-        // extend_heap returns an error
-        if (temp == NULL) {
-            return bp;
-        } else {
-            currBlock = temp;
+/**
+ * @brief Writes out the buffered text
+ * @param[in,out] out
+ */
+static void profile_flush(profile_out_t *out) {
+    size_t done = 0;
+    while (out->ok && done < out->len) {
+        ssize_t n = write(out->fd, out->buf + done, out->len - done);
+        if (n >= 0) {
+            done += (size_t)n;
+        } else if (errno != EINTR) {
+            out->ok = false;
         }
-    } else {
-        removeFromFree(currBlock, findIndex(get_size(currBlock)));
     }
-
-    // The block should be marked as free
-    dbg_assert(!get_alloc(currBlock));
-
-    // Mark block as allocated
-    size_t currBlockSize = get_size(currBlock);
-    write_block(currBlock, currBlockSize, true);
-    block_t *next = find_next(currBlock);
-    next->header = next->header | 0x2;
-    write_block(next, get_size(next), get_alloc(next));
-
-    // Try to split the block if too large
-    split_block(currBlock, asize);
-
-    bp = header_to_payload(currBlock);
-
-    dbg_ensures(mm_checkheap(__LINE__));
-
-    return bp;
+    out->len = 0;
 }
 
 /**
- * @brief
+ * @brief Appends formatted text of at most 256 bytes to the buffer.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * Formatting numbers and pointers does not allocate, so this is safe while
+ * the profiler lock is held.
  *
- * @param[in] bp
+ * @param[in,out] out
+ * @param[in] fmt printf format
  */
-void free(void *bp) {
-    dbg_requires(mm_checkheap(__LINE__));
-
-    if (bp == NULL) {
-        return;
+static void profile_print(profile_out_t *out, const char *fmt, ...) {
+    if (out->len + 256 > sizeof(out->buf)) {
+        profile_flush(out);
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt,
+                      ap);
+    va_end(ap);
+    if (n > 0) {
+        out->len += (size_t)n;
     }
-
-    block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
-
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
-
-    // Mark the block as free
-    write_block(block, size, false);
-
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
-
-    // add it to the free segList
-    addToFree(block, findIndex(get_size(block)));
-
-    dbg_ensures(mm_checkheap(__LINE__));
 }
+#endif
 
 /**
- * @brief
+ * @brief Writes the heap profile to a file, in the legacy text format of
+ * gperftools heap profiles, which pprof reads.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * Every call stack that was sampled gets a line with its live samples and
+ * bytes (or those at the peak), then all its samples and bytes ever, then
+ * its return addresses. The file ends with the mappings of the process, so
+ * pprof can resolve the addresses against the program's binaries.
  *
- * @param[in] ptr
- * @param[in] size
- * @return
+ * @param[in] path file to write, replaced if it exists
+ * @param[in] peak whether to report the samples live at the peak of the
+ *                 sampled live bytes instead of those live now
+ * @return true on success, false if no profile was started or the file
+ *         could not be written
  */
-void *realloc(void *ptr, size_t size) {
-    block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
-
-    // If size == 0, then free block and return NULL
-    if (size == 0) {
-        free(ptr);
-        return NULL;
+bool mm_profile_dump(const char *path, bool peak) {
+#if MM_PROFILE
+    if (__atomic_load_n(&profile_buckets, __ATOMIC_ACQUIRE) == NULL) {
+        return false;
     }
-
-    // If ptr is NULL, then equivalent to malloc
-    if (ptr == NULL) {
-        return malloc(size);
+    profile_out_t out = {.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644),
+                         .ok = true};
+    if (out.fd < 0) {
+        return false;
     }
 
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
-
-    // If malloc fails, the original block is left untouched
-    if (newptr == NULL) {
-        return NULL;
+    profile_lock();
+    size_t in_objs = 0, in_bytes = 0, alloc_objs = 0, alloc_bytes = 0;
+    for (size_t i = 0; i < profile_stack_max; i++) {
+        profile_stack_t *stack = &profile_stacks[i];
+        in_objs += peak ? stack->peak_objs : stack->live_objs;
+        in_bytes += peak ? stack->peak_bytes : stack->live_bytes;
+        alloc_objs += stack->alloc_objs;
+        alloc_bytes += stack->alloc_bytes;
     }
-
-    // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
-    if (size < copysize) {
-        copysize = size;
+    profile_print(&out, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+                  in_objs, in_bytes, alloc_objs, alloc_bytes, profile_rate);
+    for (size_t i = 0; i < profile_stack_max; i++) {
+        profile_stack_t *stack = &profile_stacks[i];
+        if (stack->depth == 0) {
+            continue;
+        }
+        profile_print(&out, "%6zu: %8zu [%6zu: %8zu] @",
+                      peak ? stack->peak_objs : stack->live_objs,
+                      peak ? stack->peak_bytes : stack->live_bytes,
+                      stack->alloc_objs, stack->alloc_bytes);
+        for (size_t j = 0; j < stack->depth; j++) {
+            profile_print(&out, " 0x%" PRIxPTR, (uintptr_t)stack->frames[j]);
+        }
+        profile_print(&out, "\n");
     }
-    memcpy(newptr, ptr, copysize);
+    profile_unlock();
 
-    // Free the old block
-    free(ptr);
-    return newptr;
+    profile_print(&out, "\nMAPPED_LIBRARIES:\n");
+    profile_flush(&out);
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        ssize_t n;
+        while ((n = read(maps, out.buf, sizeof(out.buf))) > 0) {
+            out.len = (size_t)n;
+            profile_flush(&out);
+        }
+        close(maps);
+    }
+    close(out.fd);
+    return out.ok;
+#else
+    return false;
+#endif
 }
 
+#if MM_PROFILE && !defined(DRIVER)
+/** @brief Prefix of the files profile_at_exit writes */
+static const char *profile_prefix;
+
 /**
- * @brief
- *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
- *
- * @param[in] elements
- * @param[in] size
- * @return
+ * @brief Writes the profiles of an interposed program as it exits: the
+ * blocks live at exit to <prefix>.<pid>.heap and those live at the peak to
+ * <prefix>.<pid>.peak.heap. Both hold every sample in their second column.
  */
-void *calloc(size_t elements, size_t size) {
-    void *bp;
-    size_t asize = elements * size;
+static void profile_at_exit(void) {
+    char path[4096];
+    mm_profile_stop();
+    snprintf(path, sizeof(path), "%s.%d.heap", profile_prefix, (int)getpid());
+    mm_profile_dump(path, false);
+    snprintf(path, sizeof(path), "%s.%d.peak.heap", profile_prefix,
+             (int)getpid());
+    mm_profile_dump(path, true);
+}
 
-    if (elements == 0) {
-        return NULL;
+/**
+ * @brief Starts a profile as the interposition library is loaded if
+ * MM_PROFILE_INTERVAL is set in the environment. MM_PROFILE_OUT sets the
+ * prefix of the files written at exit, "mm" by default.
+ */
+__attribute__((constructor)) static void profile_from_env(void) {
+    const char *interval = getenv("MM_PROFILE_INTERVAL");
+    if (interval == NULL) {
+        return;
     }
-    if (asize / elements != size) {
-        // Multiplication overflowed
-        return NULL;
+    profile_prefix = getenv("MM_PROFILE_OUT");
+    if (profile_prefix == NULL) {
+        profile_prefix = "mm";
     }
-
-    bp = malloc(asize);
-    if (bp == NULL) {
-        return NULL;
+    if (mm_profile_start((size_t)strtoull(interval, NULL, 0))) {
+        atexit(profile_at_exit);
     }
-
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
-
-    return bp;
 }
+#endif
 
 /*
  *****************************************************************************
@@ -1018,4 +5323,4 @@ void *calloc(size_t elements, size_t size) {
  * 68 21 20 2d 44 72 2e 20 45 76 69 6c 0a c5 7c fc 80 6e 57 0a               *
  *                                                                           *
  *****************************************************************************
- */
\ No newline at end of file
+ */
@@ -13,6 +13,9 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
 
 #else
 
@@ -56,8 +59,220 @@ extern void *realloc(void *ptr, size_t size);
  * @return A pointer to the first element of the array.
  */
 extern void *calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief  Allocate memory of at least `size` bytes at a multiple of
+ *         `alignment`.
+ *
+ * @param[in] alignment  The alignment, a power of 2.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *memalign(size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate memory of at least `size` bytes at a multiple of
+ *         `alignment`.
+ *
+ * @param[out] memptr  Receives a pointer to the beginning of the allocated
+ *                     bytes.
+ * @param[in] alignment  The alignment, a power of 2 multiple of
+ *                       sizeof(void *).
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  0 on success, EINVAL or ENOMEM otherwise.
+ */
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate memory of at least `size` bytes at a multiple of
+ *         `alignment`.
+ *
+ * @param[in] alignment  The alignment, a power of 2.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *aligned_alloc(size_t alignment, size_t size);
 #endif
 
+/**
+ * @brief  Marks an allocated block of known size as free.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] size  The size it was allocated (or last reallocated) with.
+ */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/**
+ * @brief  Returns the number of bytes usable at an allocated payload.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ *
+ * @return  At least the size it was allocated with, or 0 for NULL.
+ */
+extern size_t mm_usable_size(void *ptr);
+
+/**
+ * @brief  Place blocks of at least `min_size` bytes on cache line
+ *         boundaries and round them up to whole lines.
+ *
+ * Blocks handed to different threads then never share a cache line.
+ *
+ * @param[in] min_size  The threshold in bytes, or 0 to pack every block
+ *                      densely again.
+ */
+extern void mm_line_align(size_t min_size);
+
+/**
+ * @brief  Allocate `n` blocks of at least `size` bytes each at once.
+ *
+ * The blocks are cut out of one free block where possible, and each is
+ * freed on its own or with mm_free_batch.
+ *
+ * @param[in] size  The minimum size of bytes of each block.
+ * @param[in] n  The number of blocks.
+ * @param[out] out  Receives a pointer to the beginning of each block.
+ *
+ * @return  The number of blocks allocated, less than `n` if memory ran out.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/**
+ * @brief  Marks `n` allocated blocks as free at once.
+ *
+ * @param[in,out] ptrs  Pointers to the beginning of allocated payloads, or
+ *                      NULL; the array is sorted by address.
+ * @param[in] n  The number of pointers.
+ */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/**
+ * @brief  A region, whose blocks are all freed together.
+ */
+typedef struct mm_region mm_region_t;
+
+/**
+ * @brief  Create an empty region.
+ *
+ * @return  The region, or NULL if memory ran out.
+ */
+extern mm_region_t *mm_region_create(void);
+
+/**
+ * @brief  Allocate at least `size` bytes from a region.
+ *
+ * The block cannot be freed on its own; destroying the region frees it.
+ *
+ * @param[in] region  The region to allocate from.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *mm_region_alloc(mm_region_t *region, size_t size);
+
+/**
+ * @brief  Free a region and every block allocated from it.
+ *
+ * @param[in] region  The region, or NULL.
+ */
+extern void mm_region_destroy(mm_region_t *region);
+
+/**
+ * @brief  A pool of objects of one size.
+ */
+typedef struct mm_pool mm_pool_t;
+
+/**
+ * @brief  Create an empty pool of objects of `obj_size` bytes.
+ *
+ * @param[in] obj_size  The size of bytes of every object.
+ *
+ * @return  The pool, or NULL on failure.
+ */
+extern mm_pool_t *mm_pool_create(size_t obj_size);
+
+/**
+ * @brief  Allocate an object from a pool.
+ *
+ * @param[in] pool  The pool to allocate from.
+ *
+ * @return  A pointer to the beginning of the object, or NULL if memory ran
+ *          out.
+ */
+extern void *mm_pool_alloc(mm_pool_t *pool);
+
+/**
+ * @brief  Return an object to the pool it was allocated from.
+ *
+ * @param[in] pool  The pool.
+ * @param[in] obj  A pointer to the beginning of the object, or NULL.
+ */
+extern void mm_pool_free(mm_pool_t *pool, void *obj);
+
+/**
+ * @brief  Free a pool and every object allocated from it.
+ *
+ * @param[in] pool  The pool, or NULL.
+ */
+extern void mm_pool_destroy(mm_pool_t *pool);
+
+/** @brief  Most free list classes mm_stats reports on */
+#define MM_STATS_BINS 64
+
+/**
+ * @brief  Allocator statistics, in the manner of mallinfo2.
+ */
+typedef struct mm_stats {
+    size_t arena;        /* bytes in heaps, without mapped blocks */
+    size_t ordblks;      /* free blocks in the free lists */
+    size_t fordblks;     /* bytes in those blocks */
+    size_t uordblks;     /* heap bytes in use: arena - fordblks */
+    size_t hblks;        /* blocks in mem_map regions of their own */
+    size_t hblkhd;       /* bytes in those regions */
+    size_t extends;      /* times a heap grew */
+    size_t searches;     /* searches of the free lists for a fit */
+    size_t search_steps; /* free blocks those searches examined */
+    size_t nbins;        /* free list classes below */
+    size_t bin_blocks[MM_STATS_BINS]; /* free blocks per class */
+    size_t bin_bytes[MM_STATS_BINS];  /* bytes in those blocks */
+} mm_stats_t;
+
+/**
+ * @brief  Report statistics about the heap.
+ *
+ * @param[out] stats  Receives the statistics.
+ *
+ * @return  True if the allocator keeps statistics, False otherwise.
+ */
+extern bool mm_stats(mm_stats_t *stats);
+
+/**
+ * @brief  Start sampling allocations for the heap profile.
+ *
+ * @param[in] interval  The mean number of bytes allocated between samples.
+ *
+ * @return  True on success, False otherwise.
+ */
+extern bool mm_profile_start(size_t interval);
+
+/**
+ * @brief  Stop sampling allocations; sampled blocks are still tracked.
+ */
+extern void mm_profile_stop(void);
+
+/**
+ * @brief  Write the heap profile in a format pprof reads.
+ *
+ * @param[in] path  The file to write.
+ * @param[in] peak  Report the sampled blocks live at the peak instead of
+ *                  those live now.
+ *
+ * @return  True on success, False otherwise.
+ */
+extern bool mm_profile_dump(const char *path, bool peak);
+
 /**
  * @brief  Initialize the heap.
  *